@@ -2,10 +2,61 @@
 #include <vector>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <fstream>
 #include <memory>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <limits>
+#include <sstream>
 #include <stack>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <list>
+#include <functional>
+#include <future>
+#include <set>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PROJECTCC_HAVE_IO_URING 1
+#endif
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#define PROJECTCC_HAVE_PERF_EVENTS 1
+#endif
 
 using namespace std;
 
@@ -22,31 +73,468 @@ struct Token {
     TokenType type;
     string value;
     int line;
+    int constant = -1;  // Index into the constant pool for LITERAL tokens
 };
 
-class Lexer {
+bool operator==(const Token& a, const Token& b) {
+    return a.type == b.type && a.line == b.line && a.value == b.value;
+}
+
+// Deduplicated, read-only pool of string literals. All literal bytes live in
+// one contiguous buffer; entry i spans [offsets[i], offsets[i + 1]).
+//
+// image() produces a flat, position-independent layout that can be written to
+// a compiled program file and used in place after mmap via ConstantPoolView:
+//   char magic[4] = "CPL1"; uint32_t count; uint32_t offsets[count + 1]; bytes
+class ConstantPool {
 public:
-    Lexer(const string& source) : source(source), position(0), line(1) {}
+    ConstantPool() : offsets{0} {}
 
-    vector<Token> tokenize() {
-        vector<Token> tokens;
-        regex tokenPatterns(
-            "(std|ifstream|ofstream|fstream|string|while|if|else|return|int)" // Keywords
-            "|([a-zA-Z_][a-zA-Z0-9_]*)"                                    // Identifiers
-            "|(\".*?\")"                                                   // Literals
-            "|(::|\\.|<<|>>|&&|\\+\\+|--|<=|>=|==|!=|\\+=|-=|/=|\\+|-|\\|/|<|>)" // Operators
-            "|([;(){}<>\\[\\],])"                                          // Punctuation
-            "|([ \t]+)"                                                    // Whitespace
-            "|(\n)"                                                         // Newline
-            "|(.)"                                                          // Unknown
-        );
+    uint32_t intern(const string& literal) {
+        auto it = indices.find(literal);
+        if (it != indices.end()) {
+            return it->second;
+        }
+        uint32_t index = static_cast<uint32_t>(offsets.size() - 1);
+        bytes += literal;
+        offsets.push_back(static_cast<uint32_t>(bytes.size()));
+        indices.emplace(literal, index);
+        return index;
+    }
+
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    size_t byteSize() const {
+        return bytes.size();
+    }
+
+    string get(uint32_t index) const {
+        return bytes.substr(offsets[index], offsets[index + 1] - offsets[index]);
+    }
+
+    string image() const {
+        uint32_t count = static_cast<uint32_t>(size());
+        string out("CPL1", 4);
+        out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+        out.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint32_t));
+        out += bytes;
+        return out;
+    }
+
+private:
+    string bytes;
+    vector<uint32_t> offsets;
+    unordered_map<string, uint32_t> indices;
+};
+
+// Read-only view over a ConstantPool image, e.g. one mapped straight from a
+// compiled program file. Nothing is copied.
+class ConstantPoolView {
+public:
+    // Validates the whole offset table here, so get() needs no checks.
+    ConstantPoolView(const char* data, size_t size) : count(0) {
+        if (size < 8 || memcmp(data, "CPL1", 4) != 0) {
+            throw runtime_error("Invalid constant pool image");
+        }
+        memcpy(&count, data + 4, sizeof(count));
+        size_t header = 8 + (size_t(count) + 1) * sizeof(uint32_t);
+        if (size < header) {
+            throw runtime_error("Truncated constant pool image");
+        }
+        offsets = reinterpret_cast<const uint32_t*>(data + 8);
+        bytes = data + header;
+        for (size_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1]) {
+                throw runtime_error("Invalid constant pool image");
+            }
+        }
+        if (offsets[0] != 0 || offsets[count] > size - header) {
+            throw runtime_error("Truncated constant pool image");
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    string_view get(uint32_t index) const {
+        return string_view(bytes + offsets[index], offsets[index + 1] - offsets[index]);
+    }
+
+private:
+    uint32_t count;
+    const uint32_t* offsets;
+    const char* bytes;
+};
+
+// Cooperative cancellation for lexing and parsing. Another thread calls
+// cancel(); the lexer and parser poll it every few hundred tokens or every few
+// dozen statements, together with an optional deadline.
+class CancellationToken {
+public:
+    void cancel() {
+        cancelled.store(true, memory_order_relaxed);
+    }
+
+    bool isCancelled() const {
+        return cancelled.load(memory_order_relaxed);
+    }
+
+private:
+    atomic<bool> cancelled{false};
+};
+
+struct StopCondition {
+    const CancellationToken* token = nullptr;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+
+    static StopCondition after(chrono::milliseconds budget, const CancellationToken* token = nullptr) {
+        return { token, chrono::steady_clock::now() + budget };
+    }
+
+    // Returns nullptr while work may continue, otherwise why it must stop.
+    const char* reason() const {
+        if (token && token->isCancelled()) return "cancelled";
+        if (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= deadline) {
+            return "deadline exceeded";
+        }
+        return nullptr;
+    }
+};
+
+// Thrown by the parser when its StopCondition fires.
+class CompileInterrupted : public runtime_error {
+public:
+    explicit CompileInterrupted(const string& message) : runtime_error(message) {}
+};
+
+// 64-bit FNV-1a, used to key caches by content.
+uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string hexHash(uint64_t hash) {
+    static const char digits[] = "0123456789abcdef";
+    string out(16, '0');
+    for (int i = 15; i >= 0; --i, hash >>= 4) {
+        out[i] = digits[hash & 0xf];
+    }
+    return out;
+}
+
+// Scoped trace events for --trace FILE. Each thread appends to its own ring
+// buffer, so recording takes no lock; timestamps are raw TSC ticks, converted
+// to microseconds when the buffers are written out as Chrome trace JSON at
+// exit. A full ring overwrites its oldest events. A thread's ring goes back to
+// a free list when the thread exits and is reused by the next new thread, so
+// short-lived threads do not each keep one. -DPROJECTCC_NO_TRACING removes
+// the scopes.
+uint64_t traceClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct TraceEvent {
+    uint64_t start;
+    uint64_t end;
+    const char* name;      // String literals only
+    const char* category;
+    int32_t threadId;
+    char detail[36];       // Truncated copy, e.g. the file being worked on
+};
+
+class TraceBuffer {
+public:
+    static constexpr size_t capacity = 1 << 15;
+
+    TraceBuffer() : events(capacity) {}
+
+    // Only the owning thread records; written is published with release so
+    // the exit-time reader sees complete events.
+    void record(const char* name, const char* category, string_view detail, uint64_t start, uint64_t end) {
+        size_t index = written.load(memory_order_relaxed);
+        TraceEvent& event = events[index & (capacity - 1)];
+        event.start = start;
+        event.end = end;
+        event.name = name;
+        event.category = category;
+        event.threadId = owner;
+        size_t length = min(detail.size(), sizeof(event.detail) - 1);
+        memcpy(event.detail, detail.data(), length);
+        event.detail[length] = '\0';
+        written.store(index + 1, memory_order_release);
+    }
+
+    int32_t owner = 0;  // Thread recording into the ring now; earlier events keep theirs
+    vector<TraceEvent> events;
+    atomic<size_t> written{ 0 };
+};
+
+// Set in main() before any thread starts; cleared when the trace is written.
+atomic<bool> tracingEnabled{ false };
+mutex traceBuffersMutex;
+vector<unique_ptr<TraceBuffer>> traceBuffers;
+vector<TraceBuffer*> freeTraceBuffers;  // Rings of threads that have exited
+
+// Returns the thread's ring to freeTraceBuffers when the thread exits.
+struct TraceBufferLease {
+    TraceBuffer* buffer = nullptr;
+
+    ~TraceBufferLease() {
+        if (!buffer) return;
+        lock_guard<mutex> lock(traceBuffersMutex);
+        freeTraceBuffers.push_back(buffer);
+    }
+};
+
+// The calling thread's buffer, taken on its first event. Buffers are owned by
+// traceBuffers so their events outlive the threads that recorded them.
+TraceBuffer& threadTraceBuffer() {
+    thread_local TraceBufferLease lease;
+    if (!lease.buffer) {
+        lock_guard<mutex> lock(traceBuffersMutex);
+        if (freeTraceBuffers.empty()) {
+            traceBuffers.push_back(make_unique<TraceBuffer>());
+            lease.buffer = traceBuffers.back().get();
+        }
+        else {
+            lease.buffer = freeTraceBuffers.back();
+            freeTraceBuffers.pop_back();
+        }
+        lease.buffer->owner = static_cast<int32_t>(syscall(SYS_gettid));
+    }
+    return *lease.buffer;
+}
+
+class TraceScope {
+public:
+#ifdef PROJECTCC_NO_TRACING
+    TraceScope(const char*, const char*, string_view = string_view()) {}
+#else
+    // `detail` must stay valid until the scope ends.
+    TraceScope(const char* name, const char* category, string_view detail = string_view())
+        : name(name), category(category), detail(detail),
+          start(tracingEnabled.load(memory_order_relaxed) ? traceClock() : 0) {}
+
+    ~TraceScope() {
+        if (__builtin_expect(start == 0, 1) || !tracingEnabled.load(memory_order_relaxed)) return;
+        threadTraceBuffer().record(name, category, detail, start, traceClock());
+    }
+
+private:
+    const char* name;
+    const char* category;
+    string_view detail;
+    uint64_t start;
+#endif
+};
+
+// Per-phase wall and CPU time, summed over all threads and files. Scopes are
+// placed around leaf work only, so phases never overlap on one thread. While
+// --time-report is off a scope costs one predictable branch; building with
+// -DPROJECTCC_NO_PHASE_TIMING removes the timing entirely. Every phase is
+// also a trace event under --trace.
+enum Phase {
+    READ_PHASE,
+    LEX_PHASE,
+    PARSE_PHASE,
+    SYMBOLS_PHASE,
+    CHECK_PHASE,
+    QUERY_PHASE,
+    INDEX_PHASE,
+    OUTPUT_PHASE,
+    PHASES
+};
+
+const char* const phaseNames[PHASES] = { "read", "lex", "parse", "symbols", "check", "query", "index", "output" };
+
+struct PhaseTotals {
+    atomic<uint64_t> calls{ 0 };
+    atomic<uint64_t> wallNs{ 0 };
+    atomic<uint64_t> cpuNs{ 0 };
+};
+
+PhaseTotals phaseTotals[PHASES];
+bool phaseTimingEnabled = false;  // Set once in main() before any thread starts
+
+uint64_t threadCpuNs() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Hardware counters per phase for --perf-counters. Each thread opens its own
+// perf_event group (user-space cycles, instructions, cache misses and branch
+// misses) at its first phase and reads it at both ends of every phase. Events
+// the kernel or the machine refuses are left out of the group; when none can
+// be opened the report says why instead of printing numbers. When the PMU is
+// shared the kernel multiplexes the group, so each phase's counts are scaled
+// by the time the group was enabled over the time it actually ran.
+enum Counter {
+    CYCLES_COUNTER,
+    INSTRUCTIONS_COUNTER,
+    CACHE_MISSES_COUNTER,
+    BRANCH_MISSES_COUNTER,
+    COUNTERS
+};
+
+struct CounterValues {
+    uint64_t value[COUNTERS] = {};
+    uint64_t enabledNs = 0;
+    uint64_t runningNs = 0;
+};
+
+bool phaseCountersEnabled = false;  // Set once in main() before any thread starts
+atomic<bool> counterOpened[COUNTERS];
+atomic<int> counterOpenError{ 0 };
+atomic<uint64_t> phaseCounterTotals[PHASES][COUNTERS];
+atomic<uint64_t> phaseCounterEnabledNs[PHASES];
+atomic<uint64_t> phaseCounterRunningNs[PHASES];  // 0: never scheduled, no counts
+atomic<uint64_t> sourceBytesLexed{ 0 };
+
+class PerfCounterGroup {
+public:
+    PerfCounterGroup() {
+#ifdef PROJECTCC_HAVE_PERF_EVENTS
+        static const uint64_t configs[COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int counter = 0; counter < COUNTERS; ++counter) {
+            perf_event_attr attributes = {};
+            attributes.size = sizeof(attributes);
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.config = configs[counter];
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = syscall(SYS_perf_event_open, &attributes, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                counterOpenError.store(errno, memory_order_relaxed);
+                continue;
+            }
+            if (leader < 0) leader = fd;
+            fds[counter] = fd;
+            slots[counter] = members++;
+            counterOpened[counter].store(true, memory_order_relaxed);
+        }
+#else
+        counterOpenError.store(ENOSYS, memory_order_relaxed);
+#endif
+    }
+
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+    ~PerfCounterGroup() {
+        for (int fd : fds) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+
+    // Reads every counter of the group in one read(2): the member count, the
+    // group's enabled and running times, then one value per member.
+    bool sample(CounterValues& out) const {
+        if (leader < 0) return false;
+        uint64_t buffer[3 + COUNTERS];
+        if (::read(leader, buffer, sizeof(buffer)) < ssize_t(sizeof(uint64_t) * (3 + members))) return false;
+        out.enabledNs = buffer[1];
+        out.runningNs = buffer[2];
+        for (int counter = 0; counter < COUNTERS; ++counter) {
+            out.value[counter] = slots[counter] >= 0 ? buffer[3 + slots[counter]] : 0;
+        }
+        return true;
+    }
+
+private:
+    int leader = -1;
+    int members = 0;
+    int fds[COUNTERS] = { -1, -1, -1, -1 };
+    int slots[COUNTERS] = { -1, -1, -1, -1 };  // Position in the group read
+};
+
+PerfCounterGroup& threadCounters() {
+    thread_local PerfCounterGroup group;
+    return group;
+}
+
+class PhaseScope {
+public:
+#ifdef PROJECTCC_NO_PHASE_TIMING
+    explicit PhaseScope(Phase phase) : trace(phaseNames[phase], "phase") {}
+
+private:
+    TraceScope trace;
+#else
+    explicit PhaseScope(Phase phase) : trace(phaseNames[phase], "phase"), phase(phase), active(phaseTimingEnabled) {
+        if (__builtin_expect(!active, 1)) return;
+        wallStart = chrono::steady_clock::now();
+        cpuStart = threadCpuNs();
+        counted = phaseCountersEnabled && threadCounters().sample(countersStart);
+    }
+
+    ~PhaseScope() {
+        if (__builtin_expect(!active, 1)) return;
+        CounterValues countersEnd;
+        if (counted && threadCounters().sample(countersEnd)) {
+            uint64_t enabled = countersEnd.enabledNs - countersStart.enabledNs;
+            uint64_t running = countersEnd.runningNs - countersStart.runningNs;
+            phaseCounterEnabledNs[phase].fetch_add(enabled, memory_order_relaxed);
+            phaseCounterRunningNs[phase].fetch_add(running, memory_order_relaxed);
+            double scale = running > 0 ? double(enabled) / running : 0;
+            for (int counter = 0; counter < COUNTERS; ++counter) {
+                uint64_t delta = countersEnd.value[counter] - countersStart.value[counter];
+                phaseCounterTotals[phase][counter].fetch_add(uint64_t(delta * scale + 0.5), memory_order_relaxed);
+            }
+        }
+        uint64_t wall = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - wallStart).count();
+        PhaseTotals& totals = phaseTotals[phase];
+        totals.calls.fetch_add(1, memory_order_relaxed);
+        totals.wallNs.fetch_add(wall, memory_order_relaxed);
+        totals.cpuNs.fetch_add(threadCpuNs() - cpuStart, memory_order_relaxed);
+    }
 
+private:
+    TraceScope trace;
+    Phase phase;
+    bool active;
+    chrono::steady_clock::time_point wallStart;
+    uint64_t cpuStart = 0;
+    bool counted = false;
+    CounterValues countersStart;
+#endif
+};
 
+class Lexer {
+public:
+    // The lexer reads `source` in place; the bytes must outlive tokenize().
+    Lexer(string_view source) : source(source), position(0), line(1) {}
 
-        auto words_begin = sregex_iterator(source.begin(), source.end(), tokenPatterns);
-        auto words_end = sregex_iterator();
+    // When `stop` fires, tokenize() returns the tokens read so far and
+    // interruption() says why.
+    vector<Token> tokenize(const StopCondition* stop = nullptr) {
+        PhaseScope timing(LEX_PHASE);
+        if (phaseCountersEnabled) {
+            sourceBytesLexed.fetch_add(source.size(), memory_order_relaxed);
+        }
+        vector<Token> tokens;
+        const regex& tokenPatterns = patterns();
+        auto words_begin = cregex_iterator(source.data(), source.data() + source.size(), tokenPatterns);
+        auto words_end = cregex_iterator();
+        size_t matches = 0;
         for (auto it = words_begin; it != words_end; ++it) {
-            smatch match = *it;
+            if (stop && (++matches & 255) == 0 && (stopReason = stop->reason())) {
+                break;
+            }
+            const cmatch& match = *it;
             if (match[1].matched) {
                 tokens.push_back({ KEYWORD, match.str(), line });
             }
@@ -55,6 +543,7 @@ public:
             }
             else if (match[3].matched) {
                 tokens.push_back({ LITERAL, match.str(), line });
+                tokens.back().constant = constants.intern(tokens.back().value);
             }
             else if (match[4].matched) {
                 tokens.push_back({ OPERATOR, match.str(), line });
@@ -76,13 +565,58 @@ public:
             else {
                 tokens.push_back({ UNKNOWN, match.str(), line });
             }
+            // Kind, length and bytes of every token, so "a b" and "ab" differ
+            // but whitespace and line breaks never reach the hash.
+            const Token& token = tokens.back();
+            unsigned char header[5] = { static_cast<unsigned char>(token.type) };
+            uint32_t length = token.value.size();
+            memcpy(header + 1, &length, sizeof(length));
+            digest = hashBytes(reinterpret_cast<const char*>(header), sizeof(header), digest);
+            digest = hashBytes(token.value.data(), token.value.size(), digest);
         }
 
        return tokens;
     }
 
+    const ConstantPool& constantPool() const {
+        return constants;
+    }
+
+    const char* interruption() const {
+        return stopReason;
+    }
+
+    int currentLine() const {
+        return line;
+    }
+
+    // Streaming hash of the token kinds and values read by tokenize(). It does
+    // not change when a file is only reformatted, so it keys parse results.
+    uint64_t tokenHash() const {
+        return digest;
+    }
+
+    // The token regex is compiled once per process and shared by every Lexer,
+    // so only the first tokenize() pays for building it.
+    static const regex& patterns() {
+        static const regex tokenPatterns(
+            "(std|ifstream|ofstream|fstream|string|while|if|else|return|int)" // Keywords
+            "|([a-zA-Z_][a-zA-Z0-9_]*)"                                    // Identifiers
+            "|(\".*?\")"                                                   // Literals
+            "|(::|\\.|<<|>>|&&|\\+\\+|--|<=|>=|==|!=|\\+=|-=|/=|\\+|-|\\|/|<|>)" // Operators
+            "|([;(){}<>\\[\\],])"                                          // Punctuation
+            "|([ \t]+)"                                                    // Whitespace
+            "|(\n)"                                                         // Newline
+            "|(.)"                                                          // Unknown
+        );
+        return tokenPatterns;
+    }
+
 private:
-    string source;
+    ConstantPool constants;
+    const char* stopReason = nullptr;
+    uint64_t digest = hashBytes(nullptr, 0);
+    string_view source;
     size_t position;
     int line;
     stack<int> lineStack;  // Stack to track line numbers for matching braces
@@ -154,19 +688,110 @@ struct WhileLoopNode : ASTNode {
     : condition(std::move(condition)), body(std::move(body)) {}
 };
 
+enum NodeKind {
+    PROGRAM_NODE,
+    DECLARATION_NODE,       // int a, b;         type, children: identifiers
+    FILE_DECLARATION_NODE,  // ofstream f("x");  type, name, value (the literal)
+    FILE_OPERATION_NODE,    // f.close();        name, method
+    IF_NODE,
+    WHILE_NODE,
+    FOR_NODE,
+    IDENTIFIER_NODE,        // name
+    NODE_KINDS
+};
+
+const char* const nodeKindNames[NODE_KINDS] = {
+    "program", "declaration", "filedecl", "fileop", "if", "while", "for", "identifier"
+};
+
+struct SyntaxNode {
+    NodeKind kind;
+    int line;
+    uint32_t parent;
+    uint32_t end;  // One past the last node of this subtree
+    string name;
+    string type;
+    string method;
+    string value;
+};
+
+// Flat syntax tree the parser fills in when given one. Nodes are stored in
+// preorder, so a subtree is the range [id, nodes[id].end); byKind lists the
+// ids of each kind in ascending order, so the nodes of one kind inside a
+// subtree are a contiguous run of that list.
+struct SyntaxTree {
+    vector<SyntaxNode> nodes;
+    vector<uint32_t> byKind[NODE_KINDS];
+
+    uint32_t open(NodeKind kind, int line) {
+        uint32_t id = nodes.size();
+        nodes.push_back({ kind, line, openNodes.empty() ? id : openNodes.back(), 0, "", "", "", "" });
+        byKind[kind].push_back(id);
+        openNodes.push_back(id);
+        return id;
+    }
+
+    void close() {
+        nodes[openNodes.back()].end = nodes.size();
+        openNodes.pop_back();
+    }
+
+    SyntaxNode& current() {
+        return nodes[openNodes.back()];
+    }
+
+private:
+    vector<uint32_t> openNodes;  // Nodes whose subtree is still being parsed
+};
+
+// Bump whenever the parser starts accepting or rejecting different input, so
+// caches of parse results keyed by source or tokens stop reusing old answers.
+// 2: file operations accept the '.' operator.
+const uint32_t grammarVersion = 2;
+
 class Parser {
 public:
-    explicit Parser(const vector<Token>& tokens) : tokens(tokens), position(0) {}
+    explicit Parser(const vector<Token>& tokens)
+        : tokens(tokens), position(0),
+          endToken{ UNKNOWN, "end of input", tokens.empty() ? 1 : tokens.back().line } {}
 
     unique_ptr<ASTNode> parse() {
+        PhaseScope timing(PARSE_PHASE);
         return parseProgram();
     }
 
+    size_t statementsParsed() const {
+        return statementCount;
+    }
+
+    // Index of the token the parser stopped at; tokens.size() at the end.
+    size_t tokenPosition() const {
+        return position;
+    }
+
+    // Checked every 64 statements; parse() throws CompileInterrupted once it
+    // fires, after statementsParsed() statements.
+    void setStopCondition(const StopCondition* condition) {
+        stop = condition;
+    }
+
+    // When set, parse() records the statements it accepts in `syntaxTree`.
+    void setSyntaxTree(SyntaxTree* syntaxTree) {
+        tree = syntaxTree;
+    }
+
+    // Called before every top-level and nested statement; lets a scheduler
+    // pause a low-priority parse at a statement boundary.
+    void setStatementHook(function<void()> hook) {
+        statementHook = std::move(hook);
+    }
+
 private:
     stack<char> bracketStack;
     stack<int> lineStack;  // Stack to track line numbers for matching braces
 
     unique_ptr<ASTNode> parseProgram() {
+        if (tree) tree->open(PROGRAM_NODE, 1);
         while (!isAtEnd()) {
             parseStatement();
         }
@@ -174,17 +799,31 @@ private:
             int errorLine = lineStack.top();
             throw runtime_error("Mismatched brackets detected at line " + to_string(errorLine));
         }
+        if (tree) tree->close();
         return nullptr;
     }
 
+    void openNode(NodeKind kind) {
+        if (tree) tree->open(kind, previous().line);
+    }
+
+    void closeNode() {
+        if (tree) tree->close();
+    }
+
 
 
     unique_ptr<ASTNode> parseVariableDeclaration() {
         string type = previous().value;
+        openNode(DECLARATION_NODE);
+        if (tree) tree->current().type = type;
         vector<unique_ptr<IdentifierNode>> identifiers;
         do {
             if (match(IDENTIFIER)) {
                 identifiers.push_back(make_unique<IdentifierNode>(previous().value));
+                openNode(IDENTIFIER_NODE);
+                if (tree) tree->current().name = previous().value;
+                closeNode();
             } else {
                 throw runtime_error("Expected identifier in variable declaration at line " + to_string(peek().line));
             }
@@ -194,6 +833,7 @@ private:
         if (!match(PUNCTUATION, ";")) {
             throw runtime_error("Expected ';' at the end of variable declaration at line " + to_string(peek().line));
         }
+        closeNode();
 
         return make_unique<DeclarationNode>(type, move(identifiers));
     }
@@ -201,10 +841,13 @@ private:
 
 
     unique_ptr<ASTNode> parseFileDeclaration() {
+        openNode(FILE_DECLARATION_NODE);
+        if (tree) tree->current().type = previous().value;
         if (!match(IDENTIFIER)) {
             throw runtime_error("Expected identifier after file declaration keyword at line " + to_string(peek().line));
         }
         auto identifier = make_unique<IdentifierNode>(previous().value);
+        if (tree) tree->current().name = previous().value;
         if (!match(PUNCTUATION, "(")) {
             throw runtime_error("Expected '(' after file declaration identifier at line " + to_string(peek().line));
         }
@@ -213,6 +856,7 @@ private:
         if (!match(LITERAL)) {
             throw runtime_error("Expected filename literal in file declaration at line " + to_string(peek().line));
         }
+        if (tree) tree->current().value = previous().value;
         if (!match(PUNCTUATION, ")")) {
             throw runtime_error("Expected ')' after filename literal in file declaration at line " + to_string(peek().line));
         }
@@ -221,15 +865,21 @@ private:
         if (!match(PUNCTUATION, ";")) {
             throw runtime_error("Expected ';' at the end of file declaration at line " + to_string(peek().line));
         }
+        closeNode();
         return identifier;
     }
 
     unique_ptr<ASTNode> parseFileOperation() {
         auto identifier = make_unique<IdentifierNode>(previous().value);
-        if (match(PUNCTUATION, ".")) {
+        openNode(FILE_OPERATION_NODE);
+        if (tree) tree->current().name = previous().value;
+        // The lexer classifies '.' as an operator; matching it as punctuation
+        // rejected every file operation (see grammarVersion).
+        if (match(OPERATOR, ".")) {
             if (!match(IDENTIFIER)) {
                 throw runtime_error("Expected method name after '.' in file operation at line " + to_string(peek().line));
             }
+            if (tree) tree->current().method = previous().value;
             if (!match(PUNCTUATION, "(")) {
                 throw runtime_error("Expected '(' after method name in file operation at line " + to_string(peek().line));
             }
@@ -243,6 +893,7 @@ private:
             if (!match(PUNCTUATION, ";")) {
                 throw runtime_error("Expected ';' at the end of file operation at line " + to_string(peek().line));
             }
+            closeNode();
         } else {
             throw runtime_error("Unexpected token after file identifier at line " + to_string(peek().line));
         }
@@ -250,6 +901,7 @@ private:
     }
 
     unique_ptr<ASTNode> parseIfStatement() {
+        openNode(IF_NODE);
         if (!match(PUNCTUATION, "(")) {
             throw runtime_error("Expected '(' after 'if' at line " + to_string(peek().line));
         }
@@ -271,12 +923,20 @@ private:
         }
         bracketStack.pop();
         lineStack.pop();
+        closeNode();
         return nullptr;
     }
 
 
 
     void parseStatement() {
+        ++statementCount;
+        if (statementHook) statementHook();
+        if (stop && (statementCount & 63) == 0) {
+            if (const char* reason = stop->reason()) {
+                throw CompileInterrupted(string("Parsing ") + reason + " at line " + to_string(peek().line));
+            }
+        }
         if (match(KEYWORD, "int")) {
             parseVariableDeclaration();
         }
@@ -302,6 +962,7 @@ private:
 
 
     unique_ptr<ASTNode> parseWhileStatement() {
+        openNode(WHILE_NODE);
         if (!match(PUNCTUATION, "(")) {
             throw runtime_error("Expected '(' after 'while' at line " + to_string(peek().line));
         }
@@ -323,10 +984,12 @@ private:
         }
         bracketStack.pop();
         lineStack.pop();
+        closeNode();
         return nullptr;
     }
 
     unique_ptr<ASTNode> parseForStatement() {
+        openNode(FOR_NODE);
         if (!match(PUNCTUATION, "(")) {
             throw runtime_error("Expected '(' after 'for' at line " + to_string(peek().line));
         }
@@ -356,6 +1019,7 @@ private:
         }
         bracketStack.pop();
         lineStack.pop();
+        closeNode();
         return nullptr;
     }
 
@@ -365,20 +1029,27 @@ private:
             auto right = parseExpression();
             return make_unique<UnaryOperationNode>(op, std::move(right));
         }
+        if (tree && !isAtEnd() && peek().type == IDENTIFIER) {
+            tree->open(IDENTIFIER_NODE, peek().line);
+            tree->current().name = peek().value;
+            tree->close();
+        }
         advance();
         return nullptr;
     }
 
-    bool match(TokenType type, const string& value = "") {
+    // Tokens are compared in place and returned by reference so that matching
+    // never copies a token's string.
+    bool match(TokenType type, const char* value = nullptr) {
         if (isAtEnd()) return false;
-        Token token = peek();
+        const Token& token = peek();
         if (token.type != type) return false;
-        if (!value.empty() && token.value != value) return false;
+        if (value && token.value != value) return false;
         advance();
         return true;
     }
 
-    Token advance() {
+    const Token& advance() {
         if (!isAtEnd()) position++;
         return previous();
     }
@@ -387,68 +1058,5054 @@ private:
         return position >= tokens.size();
     }
 
-    Token peek() {
+    // Past the last token, peek() yields an "end of input" token on the last
+    // line so diagnostics at end of file report a real line number.
+    const Token& peek() {
+        if (isAtEnd()) return endToken;
         return tokens[position];
     }
 
-    Token previous() {
+    const Token& previous() {
         return tokens[position - 1];
     }
 
     const vector<Token>& tokens;
     size_t position;
+    size_t statementCount = 0;
+    Token endToken;
+    function<void()> statementHook;
+    const StopCondition* stop = nullptr;
+    SyntaxTree* tree = nullptr;
 };
 
-void printTokens(const vector<Token>& tokens) {
-    cout << "Lexer's Output:  " << endl;
-    for (const auto& token : tokens) {
-        cout << "Token: " << token.value << " Type: " << token.type << " Line: " << token.line << endl;
+// Disk cache of accepted sources keyed by Lexer::tokenHash(): one empty
+// marker file per token stream the parser has accepted, so re-checking a file
+// that was only reformatted skips the parse. Markers carry grammarVersion, so a
+// parser change invalidates them. Rejected sources are not stored
+// because their diagnostics carry line numbers that reformatting moves.
+class ParseCache {
+public:
+    explicit ParseCache(const string& directory) : directory(directory) {
+        std::filesystem::create_directories(directory);
     }
-}
 
-int main() {
-    cout << "\t\t\tCompiler Construction Project" << endl << endl;
-    string code = R"(
-     int a;
-     int b,c;
-     ifstream inputFile("input.txt");
-     fstream outputFile;
-     for ( int i = 0; i < 10; ++i )
-    {
-        cout << "For Loop Iteration: " << i << endl;
-        outputFile << "For Loop Iteration: " << i << endl;
+    bool accepted(uint64_t tokenHash) {
+        bool hit = access(markerPath(tokenHash).c_str(), F_OK) == 0;
+        (hit ? hits : misses).fetch_add(1, memory_order_relaxed);
+        return hit;
     }
 
+    void remember(uint64_t tokenHash) {
+        ofstream marker(markerPath(tokenHash));
+        stores.fetch_add(1, memory_order_relaxed);
+    }
 
-    int i = 0;
-    while (i < 5) {
-        cout << "While Loop Iteration: " << i << endl;
-        outputFile << "While Loop Iteration: " << i << endl;
-        ++i;
+    string statistics() const {
+        size_t lookups = hits.load() + misses.load();
+        ostringstream out;
+        out << "Parse cache: " << hits.load() << " hits, " << misses.load() << " misses ("
+            << (lookups ? 100.0 * hits.load() / lookups : 0.0) << "% hit rate), " << stores.load() << " stored";
+        return out.str();
     }
 
-    if (d > 10) {
-        cout << "d is greater than 10" << endl;
-        outputFile << "d is greater than 10" << endl;
-    } else {
-        cout << "d is 10 or less" << endl;
-        outputFile << "d is 10 or less" << endl;
+private:
+    string markerPath(uint64_t tokenHash) const {
+        return directory + "/" + hexHash(tokenHash) + ".g" + to_string(grammarVersion) + ".parsed";
     }
 
-    string line;
-    while (getline(inputFile, line)) {
-        cout << line << endl;
-        outputFile << line << endl;
+    string directory;
+    atomic<size_t> hits{ 0 };
+    atomic<size_t> misses{ 0 };
+    atomic<size_t> stores{ 0 };
+};
+
+// A declared name: "int a, b;" declares a and b, "ifstream f(...)" declares f.
+// `token` is the index of the name in the token stream.
+struct Declaration {
+    string name;
+    string type;
+    int line;
+    size_t token;
+
+    bool operator==(const Declaration& other) const {
+        return name == other.name && type == other.type && line == other.line && token == other.token;
     }
+};
 
-    inputFile.close(;
-    outputFile.close();
-    )";
+vector<Declaration> collectDeclarations(const vector<Token>& tokens) {
+    PhaseScope timing(SYMBOLS_PHASE);
+    vector<Declaration> declarations;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].type != KEYWORD) continue;
+        const string& type = tokens[i].value;
+        if (type == "int") {
+            while (i + 1 < tokens.size() && tokens[i + 1].type == IDENTIFIER) {
+                ++i;
+                declarations.push_back({ tokens[i].value, type, tokens[i].line, i });
+                if (i + 1 >= tokens.size() || tokens[i + 1].value != ",") break;
+                ++i;
+            }
+        }
+        else if ((type == "ifstream" || type == "ofstream" || type == "fstream")
+                 && i + 1 < tokens.size() && tokens[i + 1].type == IDENTIFIER) {
+            ++i;
+            declarations.push_back({ tokens[i].value, type, tokens[i].line, i });
+        }
+    }
+    return declarations;
+}
 
-    try {
-        Lexer lexer(code);
-        vector<Token> tokens = lexer.tokenize();
-        printTokens(tokens);
+// A diagnostic tied to the token it is about rather than to a line number, so
+// it is rendered against whichever token stream is current and stays valid
+// when an edit only moves lines. `token` is npos when no token carries the
+// line (the message then keeps `line`).
+struct Diagnostic {
+    string message;  // Without the " at line N" suffix
+    size_t token = string::npos;
+    int line = 0;
+
+    bool operator==(const Diagnostic& other) const {
+        return message == other.message && token == other.token && (token != string::npos || line == other.line);
+    }
+
+    string render(const vector<Token>& tokens) const {
+        int at = token < tokens.size() ? tokens[token].line : line;
+        return at > 0 ? message + " at line " + to_string(at) : message;
+    }
+};
+
+// Turns a parser message "... at line N" into a Diagnostic on the token the
+// parser stopped at, or on the first token of line N when the message points
+// elsewhere (mismatched brackets report the opening bracket's line).
+Diagnostic parseDiagnostic(const string& message, const vector<Token>& tokens, size_t position) {
+    Diagnostic diagnostic;
+    size_t at = message.rfind(" at line ");
+    if (at == string::npos) {
+        diagnostic.message = message;
+        return diagnostic;
+    }
+    diagnostic.message = message.substr(0, at);
+    diagnostic.line = atoi(message.c_str() + at + 9);
+    if (position >= tokens.size() && !tokens.empty()) position = tokens.size() - 1;
+    if (position < tokens.size() && tokens[position].line == diagnostic.line) {
+        diagnostic.token = position;
+        return diagnostic;
+    }
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].line == diagnostic.line) {
+            diagnostic.token = i;
+            break;
+        }
+    }
+    return diagnostic;
+}
+
+// File operations ("name.method(...)") on names that were not declared as
+// files. Every mode reports these after a successful parse.
+vector<Diagnostic> fileOperationDiagnostics(const vector<Token>& tokens, const vector<Declaration>& declarations) {
+    PhaseScope timing(CHECK_PHASE);
+    map<string, string> declared;
+    for (const auto& declaration : declarations) {
+        declared.emplace(declaration.name, declaration.type);
+    }
+    vector<Diagnostic> diagnostics;
+    for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+        if (tokens[i].type != IDENTIFIER || tokens[i + 1].value != ".") continue;
+        auto it = declared.find(tokens[i].value);
+        if (it == declared.end()) {
+            diagnostics.push_back({ "Use of undeclared file '" + tokens[i].value + "'", i, tokens[i].line });
+        }
+        else if (it->second == "int") {
+            diagnostics.push_back({ "'" + tokens[i].value + "' is an int, not a file,", i, tokens[i].line });
+        }
+    }
+    return diagnostics;
+}
+
+// The parse error of `tokens`, if any. CompileInterrupted propagates.
+vector<Diagnostic> parseTokens(const vector<Token>& tokens, const StopCondition* stop = nullptr,
+                               function<void()> statementHook = nullptr) {
+    Parser parser(tokens);
+    parser.setStopCondition(stop);
+    parser.setStatementHook(std::move(statementHook));
+    try {
+        parser.parse();
+    }
+    catch (const CompileInterrupted&) {
+        throw;
+    }
+    catch (const runtime_error& e) {
+        return { parseDiagnostic(e.what(), tokens, parser.tokenPosition()) };
+    }
+    return {};
+}
+
+// Bump whenever diagnoseTokens() starts reporting different diagnostics for the
+// same tokens, so caches of check results stop reusing old answers.
+// 2: file operations on undeclared or int names.
+const uint32_t checkerVersion = 2;
+
+// The diagnostics for a token stream, shared by batch, --check, the daemon,
+// the compile farm, the language server and (through its queries) --watch:
+// the parse error if there is one, otherwise fileOperationDiagnostics(). With
+// `parseCache`, a stream accepted before skips the parse.
+vector<Diagnostic> diagnoseTokens(const vector<Token>& tokens, uint64_t tokenHash = 0, const StopCondition* stop = nullptr,
+                                  ParseCache* parseCache = nullptr, function<void()> statementHook = nullptr) {
+    if (!parseCache || !parseCache->accepted(tokenHash)) {
+        vector<Diagnostic> parseError = parseTokens(tokens, stop, std::move(statementHook));
+        if (!parseError.empty()) return parseError;
+        if (parseCache) parseCache->remember(tokenHash);
+    }
+    return fileOperationDiagnostics(tokens, collectDeclarations(tokens));
+}
+
+// Lexes and checks `code`. Returns an empty string when the source is
+// accepted, otherwise its first diagnostic. With `cache`, a token stream
+// accepted before is not parsed again.
+string checkSource(string_view code, const StopCondition* stop = nullptr, ParseCache* cache = nullptr) {
+    try {
+        Lexer lexer(code);
+        vector<Token> tokens = lexer.tokenize(stop);
+        if (lexer.interruption()) {
+            return string("Lexing ") + lexer.interruption() + " at line " + to_string(lexer.currentLine());
+        }
+        vector<Diagnostic> diagnostics = diagnoseTokens(tokens, lexer.tokenHash(), stop, cache);
+        return diagnostics.empty() ? "" : diagnostics.front().render(tokens);
+    }
+    catch (const runtime_error& e) {
+        return e.what();
+    }
+}
+
+struct ParseOutcome {
+    Diagnostic diagnostic;  // Empty message when the tokens parse
+    size_t statements = 0;
+
+    bool operator==(const ParseOutcome& other) const {
+        return diagnostic == other.diagnostic && statements == other.statements;
+    }
+};
+
+enum QueryKind {
+    SOURCE_QUERY,
+    TOKENS_QUERY,
+    PARSE_QUERY,
+    SYMBOLS_QUERY,
+    CHECK_QUERY,
+    QUERY_KINDS
+};
+
+// Demand-driven, memoized compilation in the style of salsa. Sources are
+// inputs; tokens(), parse(), symbols() and check() are queries whose results
+// are cached together with the queries they read while running. Every input
+// change starts a new revision. A query asked for again in a later revision
+// first checks whether any dependency changed since it was last verified and
+// only re-runs if one did; when a re-run produces a result equal to the old
+// one, the old result keeps its revision (early cutoff), so queries depending
+// on it stay valid without running.
+class QueryEngine {
+public:
+    // Returns whether the text differed and so started a new revision.
+    bool setSource(const string& file, string text) {
+        Slot& slot = slots[{ SOURCE_QUERY, file }];
+        if (slot.value && *static_cast<const string*>(slot.value.get()) == text) return false;
+        ++revision;
+        slot.value = make_shared<string>(std::move(text));
+        slot.changedAt = revision;
+        slot.verifiedAt = revision;
+        return true;
+    }
+
+    void removeSource(const string& file) {
+        for (int kind = 0; kind < QUERY_KINDS; ++kind) {
+            slots.erase({ static_cast<QueryKind>(kind), file });
+        }
+        ++revision;
+    }
+
+    const string& source(const string& file) {
+        Key key{ SOURCE_QUERY, file };
+        record(key);
+        auto it = slots.find(key);
+        if (it == slots.end() || !it->second.value) {
+            throw runtime_error("No source for " + file);
+        }
+        ++stats[SOURCE_QUERY].hits;
+        return *static_cast<const string*>(it->second.value.get());
+    }
+
+    const vector<Token>& tokens(const string& file) {
+        return fetch<vector<Token>>(TOKENS_QUERY, file, [&] { return Lexer(source(file)).tokenize(); }, sameProgram);
+    }
+
+    const ParseOutcome& parse(const string& file) {
+        return fetch<ParseOutcome>(PARSE_QUERY, file, [&] {
+            ParseOutcome outcome;
+            const vector<Token>& stream = tokens(file);
+            Parser parser(stream);
+            try {
+                parser.parse();
+            }
+            catch (const runtime_error& e) {
+                outcome.diagnostic = parseDiagnostic(e.what(), stream, parser.tokenPosition());
+            }
+            outcome.statements = parser.statementsParsed();
+            return outcome;
+        });
+    }
+
+    const vector<Declaration>& symbols(const string& file) {
+        return fetch<vector<Declaration>>(SYMBOLS_QUERY, file, [&] { return collectDeclarations(tokens(file)); });
+    }
+
+    // The file's diagnostics, as diagnoseTokens() finds them, but built from
+    // the memoized parse() and symbols().
+    const vector<Diagnostic>& check(const string& file) {
+        return fetch<vector<Diagnostic>>(CHECK_QUERY, file, [&] {
+            const ParseOutcome& outcome = parse(file);
+            if (!outcome.diagnostic.message.empty()) {
+                return vector<Diagnostic>{ outcome.diagnostic };
+            }
+            const auto& declarations = symbols(file);
+            return fileOperationDiagnostics(tokens(file), declarations);
+        });
+    }
+
+    // check() rendered with the lines of the file's current tokens.
+    vector<string> diagnostics(const string& file) {
+        const vector<Diagnostic>& found = check(file);
+        const vector<Token>& stream = tokens(file);
+        vector<string> out;
+        for (const auto& diagnostic : found) out.push_back(diagnostic.render(stream));
+        return out;
+    }
+
+    uint64_t currentRevision() const {
+        return revision;
+    }
+
+    // Per query: fresh (already verified this revision), validated (no
+    // dependency changed), executed, and executions cut off early.
+    string statistics() const {
+        static const char* names[QUERY_KINDS] = { "source", "tokens", "parse", "symbols", "check" };
+        ostringstream out;
+        out << "Queries at revision " << revision << ":";
+        for (int kind = TOKENS_QUERY; kind < QUERY_KINDS; ++kind) {
+            const QueryStats& counts = stats[kind];
+            out << " " << names[kind] << " " << counts.hits << " fresh/" << counts.validated << " validated/"
+                << counts.executed << " run/" << counts.cutoffs << " cut off;";
+        }
+        string text = out.str();
+        text.pop_back();
+        return text;
+    }
+
+private:
+    struct Key {
+        QueryKind kind;
+        string file;
+
+        bool operator<(const Key& other) const {
+            return kind != other.kind ? kind < other.kind : file < other.file;
+        }
+    };
+
+    struct Slot {
+        shared_ptr<void> value;
+        uint64_t changedAt = 0;   // Revision in which the value last changed
+        uint64_t verifiedAt = 0;  // Revision in which the value was last known valid
+        vector<Key> dependencies;
+    };
+
+    struct QueryStats {
+        size_t hits = 0;
+        size_t validated = 0;
+        size_t executed = 0;
+        size_t cutoffs = 0;
+    };
+
+    void record(const Key& key) {
+        if (!active.empty()) active.back()->push_back(key);
+    }
+
+    // Token streams are compared without their lines for early cutoff: a stream
+    // whose tokens only moved (a blank line inserted) is the same program, so
+    // results derived from the old one stay valid.
+    static bool sameProgram(const vector<Token>& a, const vector<Token>& b) {
+        return equal(a.begin(), a.end(), b.begin(), b.end(),
+                     [](const Token& x, const Token& y) { return x.type == y.type && x.value == y.value; });
+    }
+
+    template <typename T, typename Compute, typename Same = equal_to<T>>
+    const T& fetch(QueryKind kind, const string& file, Compute compute, Same same = Same()) {
+        Key key{ kind, file };
+        record(key);
+        Slot& slot = slots[key];
+        QueryStats& counts = stats[kind];
+        if (slot.value && slot.verifiedAt == revision) {
+            ++counts.hits;
+            return *static_cast<const T*>(slot.value.get());
+        }
+        if (slot.value && !dependencyChanged(slot)) {
+            ++counts.validated;
+            slot.verifiedAt = revision;
+            return *static_cast<const T*>(slot.value.get());
+        }
+
+        vector<Key> dependencies;
+        active.push_back(&dependencies);
+        T value;
+        try {
+            value = compute();
+        }
+        catch (...) {
+            active.pop_back();
+            throw;
+        }
+        active.pop_back();
+        ++counts.executed;
+        // An equal result still replaces the stored one: equal tokens may sit on
+        // other lines, and diagnostics are rendered from the newest stream.
+        if (slot.value && same(*static_cast<const T*>(slot.value.get()), value)) {
+            ++counts.cutoffs;
+        }
+        else {
+            slot.changedAt = revision;
+        }
+        slot.value = make_shared<T>(std::move(value));
+        slot.dependencies = std::move(dependencies);
+        slot.verifiedAt = revision;
+        return *static_cast<const T*>(slot.value.get());
+    }
+
+    // Brings every dependency up to date (which may re-run it) and reports
+    // whether any of them changed after `slot` was last verified.
+    bool dependencyChanged(const Slot& slot) {
+        vector<Key> ignored;
+        active.push_back(&ignored);
+        bool changed = false;
+        for (const Key& dependency : slot.dependencies) {
+            switch (dependency.kind) {
+                case TOKENS_QUERY: tokens(dependency.file); break;
+                case PARSE_QUERY: parse(dependency.file); break;
+                case SYMBOLS_QUERY: symbols(dependency.file); break;
+                case CHECK_QUERY: check(dependency.file); break;
+                default: break;
+            }
+            auto it = slots.find(dependency);
+            if (it == slots.end() || it->second.changedAt > slot.verifiedAt) {
+                changed = true;
+                break;
+            }
+        }
+        active.pop_back();
+        return changed;
+    }
+
+    map<Key, Slot> slots;
+    vector<vector<Key>*> active;  // Dependencies recorded by the queries now running
+    uint64_t revision = 0;
+    QueryStats stats[QUERY_KINDS];
+};
+
+// Source files are read through a FileBackend so that benchmarks and tests can
+// swap the real filesystem for preloaded in-memory contents.
+class FileBackend {
+public:
+    virtual ~FileBackend() = default;
+    virtual string readFile(const string& path) = 0;
+    virtual void writeFile(const string& path, const string& contents) = 0;
+    virtual bool exists(const string& path) = 0;
+};
+
+class DiskFileBackend : public FileBackend {
+public:
+    string readFile(const string& path) override {
+        PhaseScope timing(READ_PHASE);
+        ifstream file(path, ios::binary);
+        if (!file) {
+            throw runtime_error("Could not open file: " + path);
+        }
+        stringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+    void writeFile(const string& path, const string& contents) override {
+        ofstream file(path, ios::binary);
+        if (!file || !file.write(contents.data(), contents.size())) {
+            throw runtime_error("Could not write file: " + path);
+        }
+    }
+
+    bool exists(const string& path) override {
+        return ifstream(path).good();
+    }
+};
+
+class MemoryFileBackend : public FileBackend {
+public:
+    void preload(const string& path, const string& contents) {
+        files[path] = contents;
+    }
+
+    string readFile(const string& path) override {
+        auto it = files.find(path);
+        if (it == files.end()) {
+            throw runtime_error("Could not open file: " + path);
+        }
+        return it->second;
+    }
+
+    void writeFile(const string& path, const string& contents) override {
+        files[path] = contents;
+    }
+
+    bool exists(const string& path) override {
+        return files.count(path) > 0;
+    }
+
+    // Recording format: for each file, "<path>\n<size>\n<bytes>".
+    void save(FileBackend& target, const string& recordingPath) const {
+        string out;
+        for (const auto& file : files) {
+            out += file.first + "\n" + to_string(file.second.size()) + "\n" + file.second;
+        }
+        target.writeFile(recordingPath, out);
+    }
+
+    void load(FileBackend& source, const string& recordingPath) {
+        string data = source.readFile(recordingPath);
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t pathEnd = data.find('\n', pos);
+            size_t sizeEnd = pathEnd == string::npos ? string::npos : data.find('\n', pathEnd + 1);
+            if (sizeEnd == string::npos) {
+                throw runtime_error("Malformed recording: " + recordingPath);
+            }
+            string path = data.substr(pos, pathEnd - pos);
+            size_t size = stoul(data.substr(pathEnd + 1, sizeEnd - pathEnd - 1));
+            if (sizeEnd + 1 + size > data.size()) {
+                throw runtime_error("Malformed recording: " + recordingPath);
+            }
+            files[path] = data.substr(sizeEnd + 1, size);
+            pos = sizeEnd + 1 + size;
+        }
+    }
+
+private:
+    map<string, string> files;
+};
+
+// Forwards to another backend and remembers every file read or written, so a
+// run can be saved and later replayed from a MemoryFileBackend.
+class RecordingFileBackend : public FileBackend {
+public:
+    explicit RecordingFileBackend(FileBackend& inner) : inner(inner) {}
+
+    string readFile(const string& path) override {
+        string contents = inner.readFile(path);
+        recorded.preload(path, contents);
+        return contents;
+    }
+
+    void writeFile(const string& path, const string& contents) override {
+        inner.writeFile(path, contents);
+        recorded.preload(path, contents);
+    }
+
+    bool exists(const string& path) override {
+        return inner.exists(path);
+    }
+
+    const MemoryFileBackend& recording() const {
+        return recorded;
+    }
+
+private:
+    FileBackend& inner;
+    MemoryFileBackend recorded;
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) : base(nullptr), length(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Could not open file: " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw runtime_error("Could not stat file: " + path);
+        }
+        length = info.st_size;
+        if (length > 0) {
+            base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            throw runtime_error("Could not map file: " + path);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (base) munmap(base, length);
+    }
+
+    const char* data() const {
+        return static_cast<const char*>(base);
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    void* base;
+    size_t length;
+};
+
+// Compiled-program file: the lexer's output for one source, keyed by a hash and
+// the length of the source bytes. Everything is stored at fixed offsets so the mapped file is
+// used directly:
+//   CompiledHeader | CompiledToken[tokenCount] | token text | ConstantPool image
+const uint32_t compiledFormatVersion = 2;
+
+struct CompiledHeader {
+    char magic[4];  // "PCC1"
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint32_t tokenCount;
+    uint32_t textOffset;
+    uint32_t poolOffset;
+    uint32_t poolSize;
+};
+
+struct CompiledToken {
+    uint32_t valueOffset;
+    uint32_t valueLength;
+    int32_t line;
+    int32_t constant;
+    uint32_t type;
+};
+
+void writeCompiledProgram(const string& path, uint64_t sourceHash, uint64_t sourceSize,
+                          const vector<Token>& tokens, const ConstantPool& constants) {
+    string text;
+    vector<CompiledToken> records;
+    records.reserve(tokens.size());
+    for (const auto& token : tokens) {
+        records.push_back({ static_cast<uint32_t>(text.size()), static_cast<uint32_t>(token.value.size()),
+                            token.line, token.constant, static_cast<uint32_t>(token.type) });
+        text += token.value;
+    }
+    string pool = constants.image();
+
+    CompiledHeader header = {};
+    memcpy(header.magic, "PCC1", 4);
+    header.version = compiledFormatVersion;
+    header.sourceHash = sourceHash;
+    header.sourceSize = sourceSize;
+    header.tokenCount = static_cast<uint32_t>(records.size());
+    header.textOffset = static_cast<uint32_t>(sizeof(header) + records.size() * sizeof(CompiledToken));
+    header.poolOffset = static_cast<uint32_t>((header.textOffset + text.size() + 3) & ~size_t(3));
+    header.poolSize = static_cast<uint32_t>(pool.size());
+
+    string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(CompiledToken));
+    out += text;
+    out.resize(header.poolOffset, '\0');
+    out += pool;
+
+    // Write then rename so a concurrent reader never maps a half-written file.
+    string temporary = path + ".tmp" + to_string(getpid());
+    DiskFileBackend().writeFile(temporary, out);
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        throw runtime_error("Could not write compiled program: " + path);
+    }
+}
+
+class CompiledProgram {
+public:
+    // Returns nullptr when the file is missing, from another format version,
+    // was built from different source bytes or does not hold together; a
+    // corrupt cache file is just a miss.
+    static unique_ptr<CompiledProgram> load(const string& path, uint64_t sourceHash, uint64_t sourceSize) {
+        if (access(path.c_str(), R_OK) != 0) {
+            return nullptr;
+        }
+        unique_ptr<MappedFile> file(new MappedFile(path));
+        if (file->size() < sizeof(CompiledHeader)) {
+            return nullptr;
+        }
+        const CompiledHeader* header = reinterpret_cast<const CompiledHeader*>(file->data());
+        if (memcmp(header->magic, "PCC1", 4) != 0 || header->version != compiledFormatVersion
+            || header->sourceHash != sourceHash || header->sourceSize != sourceSize
+            || header->textOffset != sizeof(CompiledHeader) + size_t(header->tokenCount) * sizeof(CompiledToken)
+            || header->poolOffset < header->textOffset
+            || size_t(header->poolOffset) + header->poolSize > file->size()) {
+            return nullptr;
+        }
+        const CompiledToken* records = reinterpret_cast<const CompiledToken*>(file->data() + sizeof(CompiledHeader));
+        size_t textSize = header->poolOffset - header->textOffset;
+        for (uint32_t i = 0; i < header->tokenCount; ++i) {
+            if (size_t(records[i].valueOffset) + records[i].valueLength > textSize || records[i].type > UNKNOWN
+                || records[i].constant < -1) {
+                return nullptr;
+            }
+        }
+        unique_ptr<CompiledProgram> program;
+        try {
+            program.reset(new CompiledProgram(std::move(file)));
+        }
+        catch (const runtime_error&) {
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < header->tokenCount; ++i) {
+            if (records[i].constant >= 0 && size_t(records[i].constant) >= program->pool.size()) return nullptr;
+        }
+        return program;
+    }
+
+    size_t tokenCount() const {
+        return header->tokenCount;
+    }
+
+    const ConstantPoolView& constantPool() const {
+        return pool;
+    }
+
+    vector<Token> tokens() const {
+        const CompiledToken* records = reinterpret_cast<const CompiledToken*>(file->data() + sizeof(CompiledHeader));
+        const char* text = file->data() + header->textOffset;
+        vector<Token> out;
+        out.reserve(header->tokenCount);
+        for (uint32_t i = 0; i < header->tokenCount; ++i) {
+            const CompiledToken& record = records[i];
+            out.push_back({ static_cast<TokenType>(record.type), string(text + record.valueOffset, record.valueLength),
+                            record.line, record.constant });
+        }
+        return out;
+    }
+
+private:
+    explicit CompiledProgram(unique_ptr<MappedFile> mapped)
+        : file(std::move(mapped)),
+          header(reinterpret_cast<const CompiledHeader*>(file->data())),
+          pool(file->data() + header->poolOffset, header->poolSize) {}
+
+    unique_ptr<MappedFile> file;
+    const CompiledHeader* header;
+    ConstantPoolView pool;
+};
+
+string compiledProgramPath(const string& cacheDir, uint64_t sourceHash) {
+    return cacheDir + "/" + hexHash(sourceHash) + ".pcc";
+}
+
+// Compares a cold compile (lex from source) with a cache hit (map the compiled
+// program file and load its tokens), `iterations` times each.
+void benchmarkStartup(const string& code, const string& cacheDir, int iterations) {
+    uint64_t sourceHash = hashBytes(code.data(), code.size());
+    string path = compiledProgramPath(cacheDir, sourceHash);
+    {
+        Lexer lexer(code);
+        vector<Token> tokens = lexer.tokenize();
+        writeCompiledProgram(path, sourceHash, code.size(), tokens, lexer.constantPool());
+    }
+
+    size_t checksum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        Lexer lexer(code);
+        checksum += lexer.tokenize().size();
+    }
+    double cold = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        unique_ptr<CompiledProgram> program = CompiledProgram::load(path, sourceHash, code.size());
+        if (!program) {
+            throw runtime_error("Compiled program cache miss: " + path);
+        }
+        checksum -= program->tokens().size();
+    }
+    double hit = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Startup benchmark: cold compile " << (cold * 1e6) / iterations << " us, cache hit "
+         << (hit * 1e6) / iterations << " us (" << cold / hit << "x)"
+         << (checksum == 0 ? "" : " [token count mismatch]") << endl;
+}
+
+// Write-behind output stream: full buffers are handed to a background thread
+// so the caller keeps producing output while the previous buffer is on its way
+// to disk. Buffers are written strictly in FIFO order and close() blocks until
+// every pending buffer has been written.
+class AsyncWriter {
+public:
+    explicit AsyncWriter(int fd, size_t bufferSize = 1 << 16)
+        : fd(fd), bufferSize(bufferSize), bytes(0), closed(false), failed(false) {
+        buffer.reserve(bufferSize);
+        worker = thread(&AsyncWriter::run, this);
+    }
+
+    // Only an explicit close() reports a failed write; here it can just be
+    // logged, since throwing while the stack unwinds terminates the program.
+    ~AsyncWriter() {
+        try {
+            close();
+        }
+        catch (const exception& error) {
+            cerr << "Warning: " << error.what() << endl;
+        }
+    }
+
+    AsyncWriter& operator<<(const string& text) {
+        write(text.data(), text.size());
+        return *this;
+    }
+
+    AsyncWriter& operator<<(const char* text) {
+        write(text, strlen(text));
+        return *this;
+    }
+
+    AsyncWriter& operator<<(long long number) {
+        return *this << to_string(number);
+    }
+
+    void write(const char* data, size_t size) {
+        buffer.append(data, size);
+        if (buffer.size() >= bufferSize) {
+            submit();
+        }
+    }
+
+    void close() {
+        if (closed) return;
+        submit();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            closed = true;
+        }
+        queueReady.notify_one();
+        worker.join();
+        if (failed) {
+            throw runtime_error(string("Write failed: ") + strerror(writeError));
+        }
+    }
+
+    size_t bytesWritten() const {
+        return bytes;
+    }
+
+private:
+    void submit() {
+        if (buffer.empty()) return;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            pending.push_back(std::move(buffer));
+        }
+        queueReady.notify_one();
+        buffer = string();
+        buffer.reserve(bufferSize);
+    }
+
+    void run() {
+        while (true) {
+            string chunk;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return closed || !pending.empty(); });
+                if (pending.empty()) return;
+                chunk = std::move(pending.front());
+                pending.pop_front();
+            }
+            size_t offset = 0;
+            while (offset < chunk.size() && !failed) {
+                ssize_t written = ::write(fd, chunk.data() + offset, chunk.size() - offset);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    writeError = errno;
+                    failed = true;
+                    break;
+                }
+                offset += written;
+            }
+            bytes += offset;
+        }
+    }
+
+    int fd;
+    size_t bufferSize;
+    string buffer;
+    deque<string> pending;
+    mutex queueMutex;
+    condition_variable queueReady;
+    thread worker;
+    size_t bytes;
+    bool closed;
+    bool failed;
+    int writeError = 0;
+};
+
+void printTokens(const vector<Token>& tokens, AsyncWriter& out) {
+    PhaseScope timing(OUTPUT_PHASE);
+    out << "Lexer's Output:  \n";
+    for (const auto& token : tokens) {
+        out << "Token: " << token.value << " Type: " << (long long)token.type
+            << " Line: " << (long long)token.line << "\n";
+    }
+}
+
+// Writes the token dump of `code` `iterations` times to /dev/null and reports
+// the write-behind throughput.
+void benchmarkWrite(const string& code, int iterations) {
+    Lexer lexer(code);
+    vector<Token> tokens = lexer.tokenize();
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open /dev/null for the write benchmark");
+    }
+    auto start = chrono::steady_clock::now();
+    size_t bytes;
+    {
+        AsyncWriter out(fd);
+        for (int i = 0; i < iterations; ++i) {
+            printTokens(tokens, out);
+        }
+        out.close();
+        bytes = out.bytesWritten();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ::close(fd);
+    cout << "Write benchmark: " << bytes << " bytes in " << seconds * 1000 << " ms ("
+         << (bytes / (1024.0 * 1024.0)) / seconds << " MB/s)" << endl;
+}
+
+// Measures what polling a StopCondition costs: `iterations` lex+parse runs
+// without one and the same number with a deadline that never fires. The two
+// kinds of run are interleaved so machine noise affects both alike.
+void benchmarkCancellation(const string& code, int iterations) {
+    CancellationToken token;
+    StopCondition stop = StopCondition::after(chrono::hours(1), &token);
+    double plain = 0;
+    double polled = 0;
+    checkSource(code);
+    for (int i = 0; i < iterations; ++i) {
+        auto start = chrono::steady_clock::now();
+        checkSource(code);
+        auto middle = chrono::steady_clock::now();
+        checkSource(code, &stop);
+        auto end = chrono::steady_clock::now();
+        plain += chrono::duration<double>(middle - start).count();
+        polled += chrono::duration<double>(end - middle).count();
+    }
+    cout << "Cancellation polling: " << (plain * 1e6) / iterations << " us/run without, "
+         << (polled * 1e6) / iterations << " us/run with (" << ((polled - plain) / plain) * 100
+         << "% overhead)" << endl;
+}
+
+// Counts heap allocations so benchmarks can report allocations per statement.
+// Opt-in with -DPROJECTCC_COUNT_ALLOCATIONS: the shared counter is touched on
+// every allocation of every thread, which batch, daemon and farm runs should
+// not pay for. The replacements are kept out of line so GCC does not pair the
+// inlined malloc/free with the default operator new and warn about a mismatch.
+#ifdef PROJECTCC_COUNT_ALLOCATIONS
+const bool countingAllocations = true;
+static atomic<size_t> allocationCount{0};
+
+size_t allocationsSoFar() {
+    return allocationCount.load(memory_order_relaxed);
+}
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+#else
+const bool countingAllocations = false;
+
+size_t allocationsSoFar() {
+    return 0;
+}
+#endif
+
+// Lexes and parses `path` `iterations` times. The source is read once through
+// the backend so only compute is measured, not disk I/O.
+void benchmarkCompile(FileBackend& files, const string& path, int iterations) {
+    string code = files.readFile(path);
+    size_t tokenCount = 0;
+    size_t statementCount = 0;
+    size_t lexAllocations = 0;
+    size_t parseAllocations = 0;
+    int failures = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        size_t before = allocationsSoFar();
+        Lexer lexer(code);
+        vector<Token> tokens = lexer.tokenize();
+        size_t afterLex = allocationsSoFar();
+        tokenCount += tokens.size();
+        Parser parser(tokens);
+        try {
+            parser.parse();
+        }
+        catch (const runtime_error&) {
+            ++failures;
+        }
+        statementCount += parser.statementsParsed();
+        lexAllocations += afterLex - before;
+        parseAllocations += allocationsSoFar() - afterLex;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Compile benchmark: " << iterations << " runs, " << tokenCount << " tokens in "
+         << seconds * 1000 << " ms (" << (seconds * 1e6) / iterations << " us/run, "
+         << failures << " with errors)" << endl;
+    if (!countingAllocations) {
+        cout << "Allocations: not counted (build with -DPROJECTCC_COUNT_ALLOCATIONS)" << endl;
+        return;
+    }
+    double statements = statementCount ? double(statementCount) : 1.0;
+    cout << "Allocations: " << lexAllocations / double(iterations) << " per lex, "
+         << parseAllocations / double(iterations) << " per parse, "
+         << (lexAllocations + parseAllocations) / statements << " per statement" << endl;
+}
+
+const string sampleCode = R"(
+     int a;
+     int b,c;
+     ifstream inputFile("input.txt");
+     fstream outputFile;
+     for ( int i = 0; i < 10; ++i )
+    {
+        cout << "For Loop Iteration: " << i << endl;
+        outputFile << "For Loop Iteration: " << i << endl;
+    }
+
+
+    int i = 0;
+    while (i < 5) {
+        cout << "While Loop Iteration: " << i << endl;
+        outputFile << "While Loop Iteration: " << i << endl;
+        ++i;
+    }
+
+    if (d > 10) {
+        cout << "d is greater than 10" << endl;
+        outputFile << "d is greater than 10" << endl;
+    } else {
+        cout << "d is 10 or less" << endl;
+        outputFile << "d is 10 or less" << endl;
+    }
+
+    string line;
+    while (getline(inputFile, line)) {
+        cout << line << endl;
+        outputFile << line << endl;
+    }
+
+    inputFile.close(;
+    outputFile.close();
+    )";
+
+// Lexes and parses one file in a forked child and reports "path: ok" or
+// "path: <diagnostic>". Returns the child's exit status.
+int checkInChild(const string& path) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw runtime_error(string("fork failed: ") + strerror(errno));
+    }
+    if (pid == 0) {
+        int status = 0;
+        try {
+            string diagnostic = checkSource(DiskFileBackend().readFile(path));
+            cout << path << ": " << (diagnostic.empty() ? "ok" : diagnostic) << "\n";
+            status = diagnostic.empty() ? 0 : 1;
+        }
+        catch (const exception& e) {
+            cout << path << ": " << e.what() << "\n";
+            status = 2;
+        }
+        cout.flush();
+        _exit(status);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+}
+
+// Forces everything a one-shot check would otherwise build lazily (the token
+// regex, iostream state, allocator arenas) so forked children inherit it.
+void warmUp() {
+    checkSource(sampleCode);
+}
+
+// Fork-server mode: the warmed-up parent reads one path per line from stdin and
+// forks a copy-on-write child per path.
+void runForkServer() {
+    warmUp();
+    string path;
+    while (getline(cin, path)) {
+        if (!path.empty()) {
+            checkInChild(path);
+        }
+    }
+}
+
+// Compares `iterations` checks of `path` through forked children of this warm
+// process with the same number of cold launches of this executable.
+void benchmarkFork(const string& path, int iterations) {
+    warmUp();
+    int devNull = open("/dev/null", O_WRONLY);
+    int savedStdout = dup(STDOUT_FILENO);
+    cout.flush();
+    dup2(devNull, STDOUT_FILENO);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        checkInChild(path);
+    }
+    double forked = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    char self[] = "/proc/self/exe";
+    string checkFlag = "--check";
+    string pathArgument = path;
+    char* arguments[] = { self, &checkFlag[0], &pathArgument[0], nullptr };
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        pid_t pid;
+        if (posix_spawn(&pid, self, nullptr, nullptr, arguments, environ) != 0) {
+            throw runtime_error("Could not launch " + string(self));
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    double cold = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    dup2(savedStdout, STDOUT_FILENO);
+    ::close(savedStdout);
+    ::close(devNull);
+    cout << "Fork benchmark: forked child " << (forked * 1e6) / iterations << " us/file, cold launch "
+         << (cold * 1e6) / iterations << " us/file" << endl;
+}
+
+string jsonEscape(const string& text) {
+    string out;
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            case '\r': out += "\\r"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                }
+                else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+// Splits a parser message of the form "... at line N" into line and text.
+// Returns line 0 when the message carries no line number.
+int diagnosticLine(const string& message) {
+    size_t at = message.rfind(" at line ");
+    if (at == string::npos) return 0;
+    return atoi(message.c_str() + at + 9);
+}
+
+// Fixed-capacity map that evicts the least recently used entry.
+class LruCache {
+public:
+    explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+    bool get(const string& key, string& value) {
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        entries.splice(entries.begin(), entries, it->second);
+        value = it->second->second;
+        return true;
+    }
+
+    void put(const string& key, const string& value) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = value;
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        entries.emplace_front(key, value);
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+private:
+    size_t capacity;
+    list<pair<string, string>> entries;
+    unordered_map<string, list<pair<string, string>>::iterator> index;
+};
+
+// Runs one lex, parse or check request over `code` and returns the JSON
+// result body (without the file name), e.g.
+//   "ok":false,"tokens":12,"diagnostics":[{"line":3,"message":"..."}]
+// An interrupted request reports the partial token count, a timeout
+// diagnostic and "interrupted":true.
+string compileRequest(const string& command, const string& code, function<void()> statementHook = nullptr,
+                      const StopCondition* stop = nullptr) {
+    Lexer lexer(code);
+    vector<Token> tokens = lexer.tokenize(stop);
+    string result = "\"tokens\":" + to_string(tokens.size())
+                  + ",\"constants\":" + to_string(lexer.constantPool().size());
+    string diagnostics;
+    bool interrupted = false;
+    if (lexer.interruption()) {
+        string message = string("Lexing ") + lexer.interruption() + " at line " + to_string(lexer.currentLine());
+        diagnostics = "{\"line\":" + to_string(lexer.currentLine()) + ",\"message\":\"" + jsonEscape(message) + "\"}";
+        interrupted = true;
+    }
+    else if (command != "lex") {
+        // "parse" reports only the parse error; "check" everything the other
+        // modes report.
+        vector<Diagnostic> found;
+        try {
+            found = command == "check" ? diagnoseTokens(tokens, 0, stop, nullptr, std::move(statementHook))
+                                       : parseTokens(tokens, stop, std::move(statementHook));
+        }
+        catch (const CompileInterrupted& e) {
+            found.push_back(parseDiagnostic(e.what(), tokens, tokens.size()));
+            interrupted = true;
+        }
+        for (const auto& diagnostic : found) {
+            string message = diagnostic.render(tokens);
+            diagnostics += (diagnostics.empty() ? "{\"line\":" : ",{\"line\":") + to_string(diagnosticLine(message))
+                         + ",\"message\":\"" + jsonEscape(message) + "\"}";
+        }
+    }
+    return string("\"ok\":") + (diagnostics.empty() ? "true," : "false,") + result
+         + ",\"diagnostics\":[" + diagnostics + "]" + (interrupted ? ",\"interrupted\":true" : "");
+}
+
+// Line-oriented reader over a socket that can also read a counted payload.
+class SocketReader {
+public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    bool readLine(string& line) {
+        size_t newline;
+        while ((newline = pending.find('\n')) == string::npos) {
+            if (!fill()) return false;
+        }
+        line = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        return true;
+    }
+
+    bool readBytes(size_t count, string& out) {
+        while (pending.size() < count) {
+            if (!fill()) return false;
+        }
+        out = pending.substr(0, count);
+        pending.erase(0, count);
+        return true;
+    }
+
+    // Discards `count` bytes without buffering them all.
+    bool skipBytes(size_t count) {
+        while (pending.size() < count) {
+            count -= pending.size();
+            pending.clear();
+            if (!fill()) return false;
+        }
+        pending.erase(0, count);
+        return true;
+    }
+
+private:
+    bool fill() {
+        char chunk[65536];
+        ssize_t received;
+        do {
+            received = read(fd, chunk, sizeof(chunk));
+        } while (received < 0 && errno == EINTR);
+        if (received <= 0) return false;
+        pending.append(chunk, received);
+        return true;
+    }
+
+    int fd;
+    string pending;
+};
+
+bool sendAll(int fd, const string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+sockaddr_un unixAddress(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("Socket path too long: " + path);
+    }
+    strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+double percentile(vector<double> samples, double fraction) {
+    if (samples.empty()) return 0;
+    size_t rank = min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()));
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+enum RequestClass {
+    INTERACTIVE,
+    BATCH
+};
+
+// Worker pool with one queue per request class. Interactive jobs are always
+// dequeued first; batch jobs may occupy at most `batchLimit` workers so some
+// workers are always free for interactive work. Running batch jobs call
+// yieldToInteractive() at statement boundaries and pause while any interactive
+// job is queued or running.
+class RequestScheduler {
+public:
+    RequestScheduler(size_t workerCount, size_t batchLimit)
+        : batchLimit(batchLimit), running{0, 0}, stopping(false) {
+        for (size_t i = 0; i < workerCount; ++i) {
+            workers.emplace_back(&RequestScheduler::workerLoop, this);
+        }
+    }
+
+    ~RequestScheduler() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        interactiveDrained.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    future<string> submit(RequestClass requestClass, function<string()> run) {
+        Job job{ std::move(run), promise<string>(), chrono::steady_clock::now() };
+        future<string> result = job.result.get_future();
+        {
+            lock_guard<mutex> lock(stateMutex);
+            queues[requestClass].push_back(std::move(job));
+        }
+        workAvailable.notify_all();
+        return result;
+    }
+
+    void yieldToInteractive() {
+        unique_lock<mutex> lock(stateMutex);
+        interactiveDrained.wait(lock, [this] {
+            return stopping || (queues[INTERACTIVE].empty() && running[INTERACTIVE] == 0);
+        });
+    }
+
+    // "interactive":{"count":N,"p50_ms":..,"p99_ms":..},"batch":{...}
+    string latencyReport() {
+        lock_guard<mutex> lock(stateMutex);
+        string out;
+        const char* names[] = { "interactive", "batch" };
+        for (int c = INTERACTIVE; c <= BATCH; ++c) {
+            vector<double> samples(latencies[c].begin(), latencies[c].end());
+            if (c != INTERACTIVE) out += ",";
+            out += "\"" + string(names[c]) + "\":{\"count\":" + to_string(samples.size())
+                 + ",\"p50_ms\":" + to_string(percentile(samples, 0.50))
+                 + ",\"p99_ms\":" + to_string(percentile(samples, 0.99)) + "}";
+        }
+        return out;
+    }
+
+private:
+    struct Job {
+        function<string()> run;
+        promise<string> result;
+        chrono::steady_clock::time_point queued;
+    };
+
+    void workerLoop() {
+        while (true) {
+            Job job;
+            RequestClass requestClass;
+            {
+                unique_lock<mutex> lock(stateMutex);
+                workAvailable.wait(lock, [this] {
+                    return stopping || !queues[INTERACTIVE].empty()
+                        || (!queues[BATCH].empty() && running[BATCH] < batchLimit);
+                });
+                if (stopping) return;
+                requestClass = !queues[INTERACTIVE].empty() ? INTERACTIVE : BATCH;
+                job = std::move(queues[requestClass].front());
+                queues[requestClass].pop_front();
+                ++running[requestClass];
+            }
+            try {
+                job.result.set_value(job.run());
+            }
+            catch (...) {
+                job.result.set_exception(current_exception());
+            }
+            double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - job.queued).count();
+            {
+                lock_guard<mutex> lock(stateMutex);
+                --running[requestClass];
+                latencies[requestClass].push_back(milliseconds);
+                if (latencies[requestClass].size() > 10000) {
+                    latencies[requestClass].pop_front();
+                }
+            }
+            workAvailable.notify_all();
+            interactiveDrained.notify_all();
+        }
+    }
+
+    size_t batchLimit;
+    size_t running[2];
+    deque<Job> queues[2];
+    deque<double> latencies[2];
+    bool stopping;
+    mutex stateMutex;
+    condition_variable workAvailable;
+    condition_variable interactiveDrained;
+    vector<thread> workers;
+};
+
+// Long-running compile service on a Unix domain socket. Each request is one
+// line, answered by one line of JSON:
+//   [batch] lex|parse|check PATH                      source read from disk
+//   [batch] lex|parse|check - NAME SIZE\n<SIZE bytes>  source sent inline
+//   stats                                             cache and latency statistics
+//   shutdown                                          stop the daemon
+// Requests are interactive unless prefixed with "batch"; see RequestScheduler.
+// Results are cached in an LRU keyed by command and a hash of the source
+// bytes, so an unchanged file is answered without lexing it again.
+class CompileDaemon {
+public:
+    // A non-zero `deadline` bounds the lex+parse time of each request.
+    CompileDaemon(const string& socketPath, size_t cacheCapacity, size_t workerCount,
+                  chrono::milliseconds deadline = chrono::milliseconds(0))
+        : socketPath(socketPath), cache(cacheCapacity), hits(0), misses(0), running(true), listener(-1),
+          deadline(deadline), scheduler(workerCount, workerCount > 1 ? workerCount - 1 : 1) {}
+
+    void serve() {
+        warmUp();
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            throw runtime_error(string("socket failed: ") + strerror(errno));
+        }
+        sockaddr_un address = unixAddress(socketPath);
+        unlink(socketPath.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listener, 64) != 0) {
+            ::close(listener);
+            throw runtime_error("Could not listen on " + socketPath + ": " + strerror(errno));
+        }
+        // Connection threads are detached and leave `clients` when they end, so
+        // finished ones do not pile up; shutdown waits for `clients` to drain.
+        while (running) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            lock_guard<mutex> lock(clientsMutex);
+            clients.insert(client);
+            thread(&CompileDaemon::serveConnection, this, client).detach();
+        }
+        {
+            unique_lock<mutex> lock(clientsMutex);
+            for (int client : clients) {
+                ::shutdown(client, SHUT_RD);
+            }
+            clientsDrained.wait(lock, [this] { return clients.empty(); });
+        }
+        ::close(listener);
+        unlink(socketPath.c_str());
+    }
+
+private:
+    void serveConnection(int client) {
+        SocketReader reader(client);
+        string line;
+        while (running && reader.readLine(line)) {
+            string response;
+            try {
+                response = handle(line, reader);
+            }
+            catch (const exception& e) {
+                response = "{\"error\":\"" + jsonEscape(e.what()) + "\"}";
+            }
+            if (!sendAll(client, response + "\n")) break;
+        }
+        lock_guard<mutex> lock(clientsMutex);
+        clients.erase(client);
+        ::close(client);
+        clientsDrained.notify_all();
+    }
+
+    string handle(const string& line, SocketReader& reader) {
+        istringstream request(line);
+        string command, path;
+        request >> command;
+        RequestClass requestClass = INTERACTIVE;
+        if (command == "batch") {
+            requestClass = BATCH;
+            request >> command;
+        }
+        request >> path;
+        if (command == "shutdown") {
+            running = false;
+            ::shutdown(listener, SHUT_RDWR);
+            return "{\"ok\":true}";
+        }
+        if (command == "stats") {
+            lock_guard<mutex> lock(cacheMutex);
+            return "{\"hits\":" + to_string(hits) + ",\"misses\":" + to_string(misses)
+                 + ",\"entries\":" + to_string(cache.size()) + "," + scheduler.latencyReport() + "}";
+        }
+        if (command != "lex" && command != "parse" && command != "check") {
+            throw runtime_error("Unknown command: " + command);
+        }
+        string name = path;
+        string code;
+        if (path == "-") {
+            size_t size = 0;
+            if (!(request >> name >> size)) {
+                throw runtime_error("Malformed inline request");
+            }
+            if (size > maxInlineBytes) {
+                reader.skipBytes(size);
+                throw runtime_error("Inline source larger than " + to_string(maxInlineBytes) + " bytes");
+            }
+            if (!reader.readBytes(size, code)) {
+                throw runtime_error("Malformed inline request");
+            }
+        }
+        else {
+            code = DiskFileBackend().readFile(path);
+        }
+        string key = command + ":" + hexHash(hashBytes(code.data(), code.size())) + ":" + to_string(code.size());
+        string result;
+        bool cached;
+        {
+            lock_guard<mutex> lock(cacheMutex);
+            cached = cache.get(key, result);
+            ++(cached ? hits : misses);
+        }
+        if (!cached) {
+            function<void()> hook;
+            if (requestClass == BATCH) {
+                hook = [this] { scheduler.yieldToInteractive(); };
+            }
+            chrono::milliseconds budget = deadline;
+            result = scheduler.submit(requestClass, [command, &code, hook, budget] {
+                StopCondition stop;
+                if (budget.count() > 0) {
+                    stop = StopCondition::after(budget);
+                }
+                return compileRequest(command, code, hook, &stop);
+            }).get();
+            if (result.find("\"interrupted\":true") == string::npos) {
+                lock_guard<mutex> lock(cacheMutex);
+                cache.put(key, result);
+            }
+        }
+        return "{\"file\":\"" + jsonEscape(name) + "\"," + result
+             + ",\"cached\":" + (cached ? "true" : "false") + "}";
+    }
+
+    string socketPath;
+    mutex cacheMutex;
+    LruCache cache;
+    size_t hits;
+    size_t misses;
+    atomic<bool> running;
+    int listener;
+    chrono::milliseconds deadline;
+    mutex clientsMutex;
+    set<int> clients;  // Open connections, one detached thread each
+    condition_variable clientsDrained;
+    RequestScheduler scheduler;
+
+    static constexpr size_t maxInlineBytes = 64 << 20;
+};
+
+// Starts a daemon on a temporary socket, keeps `batchClients` connections busy
+// with large batch checks and measures `iterations` interactive checks of a
+// small file against it.
+void benchmarkPriority(int iterations, int batchClients) {
+    string socketPath = "/tmp/projectcc-bench-" + to_string(getpid()) + ".sock";
+    size_t workers = max(2u, thread::hardware_concurrency());
+    CompileDaemon daemon(socketPath, 16, workers);
+    thread server([&daemon] { daemon.serve(); });
+    auto connectTo = [&socketPath] {
+        for (int attempt = 0; attempt < 200; ++attempt) {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address = unixAddress(socketPath);
+            if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) return fd;
+            ::close(fd);
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        throw runtime_error("Could not connect to " + socketPath);
+    };
+    auto request = [](int fd, SocketReader& reader, const string& command, const string& code) {
+        string response;
+        sendAll(fd, command + " - bench " + to_string(code.size()) + "\n" + code);
+        reader.readLine(response);
+    };
+
+    string largeCode;
+    for (int i = 0; i < 2000; ++i) {
+        largeCode += "int v" + to_string(i) + ";\n";
+    }
+    atomic<bool> loading(true);
+    vector<thread> batchLoad;
+    for (int c = 0; c < batchClients; ++c) {
+        batchLoad.emplace_back([&, c] {
+            int fd = connectTo();
+            SocketReader reader(fd);
+            for (int n = 0; loading; ++n) {
+                // A distinct trailing declaration defeats the result cache.
+                request(fd, reader, "batch check", largeCode + "int b" + to_string(c) + "_" + to_string(n) + ";\n");
+            }
+            ::close(fd);
+        });
+    }
+
+    int fd = connectTo();
+    SocketReader reader(fd);
+    vector<double> latencies;
+    for (int i = 0; i < iterations; ++i) {
+        auto start = chrono::steady_clock::now();
+        request(fd, reader, "check", "int i" + to_string(i) + ";\n");
+        latencies.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    string stats;
+    sendAll(fd, "stats\n");
+    reader.readLine(stats);
+    loading = false;
+    for (auto& client : batchLoad) {
+        client.join();
+    }
+    sendAll(fd, "shutdown\n");
+    reader.readLine(stats);
+    ::close(fd);
+    server.join();
+
+    cout << "Interactive latency under batch load (" << batchClients << " batch clients): p50 "
+         << percentile(latencies, 0.50) << " ms, p99 " << percentile(latencies, 0.99) << " ms" << endl;
+}
+
+// Thin client: sends one request per path to the daemon and prints the JSON
+// answers. A path of "-" sends standard input as an inline buffer.
+int runClient(const string& socketPath, const string& command, const vector<string>& paths) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unixAddress(socketPath);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        throw runtime_error("Could not connect to " + socketPath + ": " + strerror(errno));
+    }
+    SocketReader reader(fd);
+    vector<string> targets = paths.empty() ? vector<string>{ "" } : paths;
+    int status = 0;
+    for (const auto& path : targets) {
+        string request = command;
+        if (path == "-") {
+            stringstream input;
+            input << cin.rdbuf();
+            string code = input.str();
+            request += " - <stdin> " + to_string(code.size()) + "\n" + code;
+        }
+        else {
+            request += (path.empty() ? "" : " " + path) + "\n";
+        }
+        string response;
+        if (!sendAll(fd, request) || !reader.readLine(response)) {
+            ::close(fd);
+            throw runtime_error("Lost connection to " + socketPath);
+        }
+        cout << response << "\n";
+        if (response.find("\"ok\":false") != string::npos || response.find("\"error\"") != string::npos) {
+            status = 1;
+        }
+    }
+    ::close(fd);
+    return status;
+}
+
+// Thread pool in which every worker owns a deque of tasks. A worker pops from
+// the back of its own deque and, once that is empty, steals from the front of
+// the others, so a worker that drew long tasks does not hold up the rest.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threadCount)
+        : queues(max<size_t>(1, threadCount)), nextQueue(0), pending(0), finishing(false) {}
+
+    ~WorkStealingPool() {
+        finish();
+    }
+
+    // Runs `tasks`, keeping their relative order per worker, and blocks until
+    // all of them are done.
+    void run(vector<function<void()>> tasks) {
+        start();
+        for (auto& task : tasks) {
+            submit(std::move(task));
+        }
+        finish();
+    }
+
+    // The pool can be started again after finish(); workers of the new run must
+    // not see the previous run's `finishing` and exit at once.
+    void start() {
+        {
+            lock_guard<mutex> guard(idleMutex);
+            finishing = false;
+        }
+        for (size_t i = 0; i < queues.size(); ++i) {
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    // Deals tasks round-robin; each lands at the front of a worker's deque so
+    // the owner runs its tasks in submission order.
+    void submit(function<void()> task) {
+        // Count the task before publishing it so a worker that takes it at once
+        // never sees the counter drop below zero.
+        {
+            lock_guard<mutex> guard(idleMutex);
+            ++pending;
+        }
+        WorkerQueue& queue = queues[nextQueue++ % queues.size()];
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_front(std::move(task));
+        }
+        idle.notify_one();
+    }
+
+    // Waits for every submitted task and stops the workers.
+    void finish() {
+        {
+            lock_guard<mutex> guard(idleMutex);
+            finishing = true;
+        }
+        idle.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    size_t threadCount() const {
+        return queues.size();
+    }
+
+private:
+    struct WorkerQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool take(size_t worker, function<void()>& task) {
+        {
+            WorkerQueue& own = queues[worker];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            WorkerQueue& victim = queues[(worker + offset) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t worker) {
+        function<void()> task;
+        while (true) {
+            if (take(worker, task)) {
+                {
+                    lock_guard<mutex> guard(idleMutex);
+                    --pending;
+                }
+                task();
+                continue;
+            }
+            unique_lock<mutex> guard(idleMutex);
+            if (!(pending > 0 || finishing)) {
+                TraceScope trace("idle", "stall");
+                idle.wait(guard, [this] { return pending > 0 || finishing; });
+            }
+            if (pending == 0 && finishing) return;
+        }
+    }
+
+    vector<WorkerQueue> queues;
+    vector<thread> workers;
+    size_t nextQueue;
+    size_t pending;
+    bool finishing;
+    mutex idleMutex;
+    condition_variable idle;
+};
+
+// One input of the batch driver. Members of a tar archive carry `data`, which
+// points into the mapped archive that `archive` keeps alive.
+struct SourceFile {
+    string path;
+    size_t size = 0;
+    shared_ptr<MappedFile> archive = nullptr;
+    const char* data = nullptr;
+};
+
+uint64_t parseTarNumber(const char* field, size_t length) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < length && field[i]; ++i) {
+        if (field[i] == ' ') continue;
+        if (field[i] < '0' || field[i] > '7') {
+            throw runtime_error("Unsupported tar number field");
+        }
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Reads the "length key=value\n" records of a PAX extended header into
+// `records`, later records replacing earlier ones.
+void parsePaxRecords(const char* data, size_t size, const string& path, map<string, string>& records) {
+    size_t position = 0;
+    while (position < size && data[position]) {
+        size_t length = 0;
+        size_t digits = position;
+        while (digits < size && data[digits] >= '0' && data[digits] <= '9' && length < size) {
+            length = length * 10 + (data[digits++] - '0');
+        }
+        const char* record = data + position;
+        if (digits == position || digits >= size || data[digits] != ' ' ||
+            length <= digits + 1 - position || length > size - position || record[length - 1] != '\n') {
+            throw runtime_error("Corrupt PAX header in " + path);
+        }
+        const char* key = data + digits + 1;
+        const char* end = record + length - 1;
+        const char* equals = static_cast<const char*>(memchr(key, '=', end - key));
+        if (!equals) {
+            throw runtime_error("Corrupt PAX header in " + path);
+        }
+        records[string(key, equals)] = string(equals + 1, end);
+        position += length;
+    }
+}
+
+// Maps an uncompressed tar archive and lists its regular files as sources named
+// "archive.tar:member/path". Member bytes are not copied; the lexer reads them
+// straight from the mapping. Supports ustar prefixes, GNU long names and the
+// path and size records of PAX headers; the headers themselves are not members.
+vector<SourceFile> tarMembers(const string& path) {
+    auto archive = make_shared<MappedFile>(path);
+    const char* data = archive->data();
+    size_t size = archive->size();
+    vector<SourceFile> members;
+    string longName;
+    map<string, string> globalRecords;
+    map<string, string> memberRecords;
+    size_t offset = 0;
+    while (offset + 512 <= size) {
+        const char* header = data + offset;
+        if (all_of(header, header + 512, [](char c) { return c == 0; })) break;
+
+        unsigned checksum = 0;
+        for (int i = 0; i < 512; ++i) {
+            checksum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (checksum != parseTarNumber(header + 148, 8)) {
+            throw runtime_error("Corrupt tar header in " + path + " at offset " + to_string(offset));
+        }
+        string name(header, strnlen(header, 100));
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            name = string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+        }
+        char type = header[156];
+        auto record = [&](const string& key) -> const string* {
+            auto found = memberRecords.find(key);
+            if (found != memberRecords.end()) return &found->second;
+            found = globalRecords.find(key);
+            return found != globalRecords.end() ? &found->second : nullptr;
+        };
+        size_t memberSize = parseTarNumber(header + 124, 12);
+        if (type != 'x' && type != 'g' && record("size")) {
+            memberSize = strtoull(record("size")->c_str(), nullptr, 10);
+        }
+        size_t body = offset + 512;
+        if (memberSize > size - body) {
+            throw runtime_error("Truncated tar member in " + path + ": " + name);
+        }
+        if (type == 'L') {
+            longName.assign(data + body, strnlen(data + body, memberSize));
+        }
+        else if (type == 'x') {
+            parsePaxRecords(data + body, memberSize, path, memberRecords);
+        }
+        else if (type == 'g') {
+            parsePaxRecords(data + body, memberSize, path, globalRecords);
+        }
+        else {
+            if (type == '0' || type == '\0') {
+                if (record("path")) name = *record("path");
+                else if (!longName.empty()) name = longName;
+                members.push_back({ path + ":" + name, memberSize, archive, data + body });
+            }
+            longName.clear();
+            memberRecords.clear();
+        }
+        offset = body + (memberSize + 511) / 512 * 512;
+    }
+    return members;
+}
+
+// Whether a directory walk picks up `path`: files with one of the source
+// extensions below, unless hidden. Binaries, Makefiles, objects, archives,
+// editor backups and the like inside a tree are left alone; name such a file
+// on the command line to check it anyway.
+bool isSourcePath(const std::filesystem::path& path) {
+    static const set<string> sourceExtensions = { ".src", ".cc", ".cpp", ".cxx", ".c", ".h", ".hpp" };
+    string name = path.filename().string();
+    if (name.empty() || name[0] == '.') return false;
+    return sourceExtensions.count(path.extension().string()) > 0;
+}
+
+// Walks `root` recursively and returns its source files in path order, adding
+// every directory entered to `directories` when given. Hidden directories are
+// not entered; directories and files that cannot be read are reported and
+// skipped rather than ending the walk.
+vector<SourceFile> walkSourceTree(const string& root, vector<string>* directories = nullptr) {
+    namespace fs = std::filesystem;
+    vector<SourceFile> found;
+    if (directories) directories->push_back(fs::path(root).lexically_normal().string());
+    error_code error;
+    fs::recursive_directory_iterator walk(root, fs::directory_options::skip_permission_denied, error);
+    for (; !error && walk != fs::recursive_directory_iterator(); walk.increment(error)) {
+        const fs::path& path = walk->path();
+        error_code entryError;
+        if (walk->is_directory(entryError)) {
+            if (path.filename().string()[0] == '.') {
+                walk.disable_recursion_pending();
+            }
+            else if (access(path.c_str(), R_OK | X_OK) != 0) {
+                cerr << "Warning: skipping directory " << path.string() << ": " << strerror(errno) << endl;
+                walk.disable_recursion_pending();
+            }
+            else if (directories) {
+                directories->push_back(path.lexically_normal().string());
+            }
+            continue;
+        }
+        if (!walk->is_regular_file(entryError) || !isSourcePath(path)) continue;
+        uintmax_t size = walk->file_size(entryError);
+        if (entryError || access(path.c_str(), R_OK) != 0) {
+            cerr << "Warning: skipping " << path.string() << ": " << (entryError ? entryError.message() : strerror(errno)) << endl;
+            continue;
+        }
+        found.push_back({ path.string(), static_cast<size_t>(size) });
+    }
+    if (error) {
+        cerr << "Warning: stopped walking " << root << ": " << error.message() << endl;
+    }
+    sort(found.begin(), found.end(), [](const SourceFile& a, const SourceFile& b) { return a.path < b.path; });
+    return found;
+}
+
+// Expands the command-line inputs: files are taken as they are, directories
+// are walked for source files (walkSourceTree), "*.tar" archives contribute their members and "@list"
+// reads one path per line from `list`.
+vector<SourceFile> collectSources(const vector<string>& inputs) {
+    namespace fs = std::filesystem;
+    vector<SourceFile> sources;
+    for (const auto& input : inputs) {
+        if (!input.empty() && input[0] == '@') {
+            ifstream list(input.substr(1));
+            if (!list) {
+                throw runtime_error("Could not open file list: " + input.substr(1));
+            }
+            vector<string> listed;
+            string line;
+            while (getline(list, line)) {
+                if (!line.empty()) listed.push_back(line);
+            }
+            vector<SourceFile> expanded = collectSources(listed);
+            sources.insert(sources.end(), expanded.begin(), expanded.end());
+        }
+        else if (input.size() > 4 && input.compare(input.size() - 4, 4, ".tar") == 0) {
+            vector<SourceFile> members = tarMembers(input);
+            sources.insert(sources.end(), members.begin(), members.end());
+        }
+        else if (fs::is_directory(input)) {
+            vector<SourceFile> found = walkSourceTree(input);
+            sources.insert(sources.end(), found.begin(), found.end());
+        }
+        else {
+            error_code error;
+            uintmax_t size = fs::file_size(input, error);
+            sources.push_back({ input, error ? 0 : static_cast<size_t>(size) });
+        }
+    }
+    return sources;
+}
+
+struct BatchResult {
+    string diagnostic;
+    bool ok = false;
+    string output;  // Everything this file prints, emitted in input order
+};
+
+struct BatchOptions {
+    size_t threads = 1;
+    int deadlineMs = 0;
+    bool useIoUring = true;
+    size_t reorderWindow = 256;
+    ParseCache* parseCache = nullptr;
+};
+
+// Hands per-file results to `emit` in input order although files finish in any
+// order. A result is held back until every earlier file has been emitted; at
+// most `window` files past the oldest unfinished one may be started, which
+// caps how many finished results wait in memory.
+class OutputSequencer {
+public:
+    OutputSequencer(size_t window, function<void(size_t, const BatchResult&)> emit)
+        : window(max<size_t>(1, window)), nextIndex(0), emit(std::move(emit)) {}
+
+    bool hasRoom(size_t index) {
+        lock_guard<mutex> lock(stateMutex);
+        return index < nextIndex + window;
+    }
+
+    void waitForRoom(size_t index) {
+        unique_lock<mutex> lock(stateMutex);
+        if (index < nextIndex + window) return;
+        TraceScope trace("wait for reorder window", "stall");
+        advanced.wait(lock, [&] { return index < nextIndex + window; });
+    }
+
+    // Returns false, dropping the result, when `index` was already completed.
+    bool complete(size_t index, BatchResult result) {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (index < nextIndex || !waiting.emplace(index, std::move(result)).second) return false;
+            for (auto it = waiting.begin(); it != waiting.end() && it->first == nextIndex; it = waiting.erase(it)) {
+                emit(it->first, it->second);
+                ++nextIndex;
+            }
+        }
+        advanced.notify_all();
+        return true;
+    }
+
+private:
+    size_t window;
+    size_t nextIndex;
+    map<size_t, BatchResult> waiting;
+    function<void(size_t, const BatchResult&)> emit;
+    mutex stateMutex;
+    condition_variable advanced;
+};
+
+// Reads a whole file with plain open/fstat/read/close, counting the syscalls.
+string readWholeFile(const string& path, atomic<size_t>& syscalls) {
+    PhaseScope timing(READ_PHASE);
+    int fd = open(path.c_str(), O_RDONLY);
+    syscalls.fetch_add(1, memory_order_relaxed);
+    if (fd < 0) {
+        throw runtime_error("Could not open file: " + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    syscalls.fetch_add(1, memory_order_relaxed);
+    string contents(fstat(fd, &info) == 0 ? info.st_size : 0, '\0');
+    size_t done = 0;
+    while (true) {
+        if (done == contents.size()) contents.resize(done + 4096);
+        ssize_t got = read(fd, &contents[done], contents.size() - done);
+        syscalls.fetch_add(1, memory_order_relaxed);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        done += got;
+    }
+    contents.resize(done);
+    ::close(fd);
+    syscalls.fetch_add(1, memory_order_relaxed);
+    return contents;
+}
+
+#ifdef PROJECTCC_HAVE_IO_URING
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency).
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) : syscalls(0), toSubmit(0) {
+        io_uring_params params = {};
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        ++syscalls;
+        if (ringFd < 0) {
+            throw runtime_error(string("io_uring unavailable: ") + strerror(errno));
+        }
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+        }
+        sqMap = mapRing(sqMapSize, IORING_OFF_SQ_RING);
+        cqMap = singleMap ? sqMap : mapRing(cqMapSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mapRing(sqesSize, IORING_OFF_SQES));
+
+        char* sq = static_cast<char*>(sqMap);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        localTail = *sqTail;
+        char* cq = static_cast<char*>(cqMap);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        munmap(sqes, sqesSize);
+        if (cqMap != sqMap) munmap(cqMap, cqMapSize);
+        munmap(sqMap, sqMapSize);
+        ::close(ringFd);
+    }
+
+    // Throws unless the kernel implements every opcode in `opcodes`. OPENAT,
+    // CLOSE and READ arrived in 5.6, after io_uring itself; older kernels also
+    // lack IORING_REGISTER_PROBE, which counts as unsupported.
+    void requireOperations(initializer_list<uint8_t> opcodes) {
+        const unsigned probeOps = 256;
+        vector<char> storage(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        ++syscalls;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, probeOps) != 0) {
+            throw runtime_error(string("io_uring probe failed: ") + strerror(errno));
+        }
+        for (uint8_t opcode : opcodes) {
+            if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+                throw runtime_error("io_uring does not support opcode " + to_string(opcode));
+            }
+        }
+    }
+
+    void registerBuffers(const vector<iovec>& buffers) {
+        ++syscalls;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) != 0) {
+            throw runtime_error(string("io_uring buffer registration failed: ") + strerror(errno));
+        }
+    }
+
+    // Returns a zeroed submission entry; throws when the queue is full.
+    io_uring_sqe& nextEntry() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (localTail - head >= sqEntries) {
+            throw runtime_error("io_uring submission queue full");
+        }
+        unsigned index = localTail & sqMask;
+        io_uring_sqe& entry = sqes[index];
+        memset(&entry, 0, sizeof(entry));
+        sqArray[index] = index;
+        ++localTail;
+        ++toSubmit;
+        return entry;
+    }
+
+    // Submits queued entries and waits until at least one completion is ready.
+    void submitAndWait() {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        while (true) {
+            ++syscalls;
+            long submitted = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted >= 0) {
+                toSubmit -= static_cast<unsigned>(submitted);
+                return;
+            }
+            if (errno != EINTR) {
+                throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+            }
+        }
+    }
+
+    bool nextCompletion(io_uring_cqe& completion) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+        completion = cqes[head & cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    size_t syscalls;
+
+private:
+    void* mapRing(size_t size, off_t offset) {
+        ++syscalls;
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        if (map == MAP_FAILED) {
+            throw runtime_error(string("io_uring mmap failed: ") + strerror(errno));
+        }
+        return map;
+    }
+
+    int ringFd;
+    void* sqMap;
+    void* cqMap;
+    size_t sqMapSize;
+    size_t cqMapSize;
+    size_t sqesSize;
+    io_uring_sqe* sqes;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned localTail;
+    unsigned toSubmit;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+};
+
+// Reads `sources` in `order` with up to 64 files in flight: opens, reads and
+// closes are batched into shared io_uring submissions. Files up to 64 KiB are
+// read into registered buffers (READ_FIXED); larger ones into their own
+// string. `deliver(index, contents, error)` is called on this thread as each
+// file completes. A file is only opened once `sequencer` has room for it.
+// Sources already in memory (tar members) are passed to `startInMemory` when
+// their turn comes. If the ring fails part way, files it still holds open are
+// closed before the error propagates; files not yet delivered are the caller's.
+void readSourcesWithIoUring(const vector<SourceFile>& sources, const vector<size_t>& order, OutputSequencer& sequencer,
+                            const function<void(size_t)>& startInMemory,
+                            const function<void(size_t, string, string)>& deliver, atomic<size_t>& syscalls) {
+    const unsigned slotCount = 64;
+    const size_t slotSize = 64 * 1024;
+    enum Operation : uint64_t { OPEN, READ, CLOSE };
+    struct Slot {
+        size_t index = 0;
+        int fd = -1;  // Open file while the slot is in use; -1 otherwise
+        size_t expected = 0;
+        size_t done = 0;
+        string large;
+    };
+
+    IoUring ring(slotCount * 2);
+    ring.requireOperations({ IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_CLOSE });
+    vector<char> arena(slotCount * slotSize);
+    vector<iovec> buffers(slotCount);
+    for (unsigned i = 0; i < slotCount; ++i) {
+        buffers[i] = { arena.data() + i * slotSize, slotSize };
+    }
+    ring.registerBuffers(buffers);
+
+    vector<Slot> slots(slotCount);
+    vector<unsigned> freeSlots;
+    for (unsigned i = slotCount; i > 0; --i) freeSlots.push_back(i - 1);
+    size_t next = 0;
+    size_t inFlight = 0;
+    size_t closing = 0;
+
+    auto queueRead = [&](unsigned slotIndex) {
+        Slot& slot = slots[slotIndex];
+        io_uring_sqe& entry = ring.nextEntry();
+        entry.fd = slot.fd;
+        entry.off = slot.done;
+        entry.user_data = (uint64_t(slotIndex) << 2) | READ;
+        if (slot.expected > slotSize) {
+            entry.opcode = IORING_OP_READ;
+            entry.addr = reinterpret_cast<uint64_t>(&slot.large[slot.done]);
+            entry.len = static_cast<unsigned>(slot.expected - slot.done);
+        }
+        else {
+            entry.opcode = IORING_OP_READ_FIXED;
+            entry.addr = reinterpret_cast<uint64_t>(arena.data() + slotIndex * slotSize + slot.done);
+            entry.len = static_cast<unsigned>(slotSize - slot.done);
+            entry.buf_index = static_cast<uint16_t>(slotIndex);
+        }
+    };
+    auto release = [&](unsigned slotIndex, bool closeFile) {
+        if (closeFile) {
+            io_uring_sqe& entry = ring.nextEntry();
+            entry.opcode = IORING_OP_CLOSE;
+            entry.fd = slots[slotIndex].fd;
+            entry.user_data = CLOSE;
+            ++closing;
+        }
+        slots[slotIndex].fd = -1;
+        slots[slotIndex].large = string();
+        freeSlots.push_back(slotIndex);
+        --inFlight;
+    };
+
+    try {
+        while (next < order.size() || inFlight > 0 || closing > 0) {
+            while (next < order.size() && !freeSlots.empty()) {
+                if (!sequencer.hasRoom(order[next])) {
+                    // Only block when nothing is in flight that could still need reaping.
+                    if (inFlight > 0 || closing > 0) break;
+                    sequencer.waitForRoom(order[next]);
+                }
+                size_t index = order[next++];
+                if (sources[index].data) {
+                    startInMemory(index);
+                    continue;
+                }
+                unsigned slotIndex = freeSlots.back();
+                freeSlots.pop_back();
+                slots[slotIndex] = { index, -1, sources[index].size, 0, string() };
+                io_uring_sqe& entry = ring.nextEntry();
+                entry.opcode = IORING_OP_OPENAT;
+                entry.fd = AT_FDCWD;
+                entry.addr = reinterpret_cast<uint64_t>(sources[index].path.c_str());
+                entry.open_flags = O_RDONLY;
+                entry.user_data = (uint64_t(slotIndex) << 2) | OPEN;
+                ++inFlight;
+            }
+            if (inFlight == 0 && closing == 0) {
+                continue;  // Only in-memory sources were started; nothing to wait for.
+            }
+            {
+                PhaseScope timing(READ_PHASE);
+                ring.submitAndWait();
+            }
+            io_uring_cqe completion;
+            while (ring.nextCompletion(completion)) {
+                Operation operation = static_cast<Operation>(completion.user_data & 3);
+                if (operation == CLOSE) {
+                    --closing;
+                    continue;
+                }
+                unsigned slotIndex = static_cast<unsigned>(completion.user_data >> 2);
+                Slot& slot = slots[slotIndex];
+                const string& path = sources[slot.index].path;
+                if (completion.res < 0) {
+                    deliver(slot.index, "", string(operation == OPEN ? "Could not open file: " : "Could not read file: ")
+                                            + path + ": " + strerror(-completion.res));
+                    release(slotIndex, operation == READ);
+                    continue;
+                }
+                if (operation == OPEN) {
+                    slot.fd = completion.res;
+                    if (slot.expected > slotSize) {
+                        slot.large.resize(slot.expected);
+                    }
+                }
+                else {
+                    slot.done += completion.res;
+                    bool full = slot.expected > slotSize ? slot.done >= slot.expected : slot.done >= slotSize;
+                    if (completion.res == 0 || slot.done >= slot.expected || full) {
+                        string contents;
+                        if (slot.expected > slotSize) {
+                            slot.large.resize(slot.done);
+                            contents = std::move(slot.large);
+                        }
+                        else {
+                            contents.assign(arena.data() + slotIndex * slotSize, slot.done);
+                        }
+                        deliver(slot.index, std::move(contents), "");
+                        release(slotIndex, true);
+                        continue;
+                    }
+                }
+                queueRead(slotIndex);
+            }
+        }
+    }
+    catch (...) {
+        // Opens that completed but were never reaped, and files whose slot is
+        // still in use, would otherwise leak their descriptors.
+        io_uring_cqe completion;
+        while (ring.nextCompletion(completion)) {
+            if ((completion.user_data & 3) == OPEN && completion.res >= 0) ::close(completion.res);
+        }
+        for (const Slot& slot : slots) {
+            if (slot.fd >= 0) ::close(slot.fd);
+        }
+        syscalls.fetch_add(ring.syscalls, memory_order_relaxed);
+        throw;
+    }
+    syscalls.fetch_add(ring.syscalls, memory_order_relaxed);
+}
+#endif
+
+// Dispatch order for the batch: inputs are cut into blocks of `window` and each
+// block is dispatched largest first (longest-processing-time order), so big
+// files do not start last and become stragglers while the reorder window still
+// moves forward through the inputs.
+vector<size_t> dispatchOrder(const vector<SourceFile>& sources, size_t window) {
+    vector<size_t> order(sources.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    for (size_t block = 0; block < order.size(); block += window) {
+        auto end = order.begin() + min(order.size(), block + window);
+        stable_sort(order.begin() + block, end, [&](size_t a, size_t b) { return sources[a].size > sources[b].size; });
+    }
+    return order;
+}
+
+// Checks every source on `options.threads` workers and passes each result to
+// `sequencer`, which emits them in input order. With io_uring the calling
+// thread reads the files in batches and hands each one to the pool as it
+// completes; otherwise every worker reads its own files.
+void checkSources(const vector<SourceFile>& sources, const BatchOptions& options, OutputSequencer& sequencer,
+                  atomic<size_t>& syscalls, bool& usedIoUring) {
+    size_t window = max<size_t>(1, options.reorderWindow);
+    vector<size_t> order = dispatchOrder(sources, window);
+
+    int deadlineMs = options.deadlineMs;
+    ParseCache* parseCache = options.parseCache;
+    auto finish = [&sources, &sequencer](size_t index, BatchResult result) {
+        result.output = sources[index].path + ": " + (result.ok ? string("ok") : result.diagnostic) + "\n";
+        sequencer.complete(index, std::move(result));
+    };
+    auto check = [&sources, finish, deadlineMs, parseCache](size_t index, string_view code) {
+        TraceScope trace("check file", "file", sources[index].path);
+        StopCondition stop;
+        if (deadlineMs > 0) {
+            stop = StopCondition::after(chrono::milliseconds(deadlineMs));
+        }
+        BatchResult result;
+        result.diagnostic = checkSource(code, &stop, parseCache);
+        result.ok = result.diagnostic.empty();
+        finish(index, std::move(result));
+    };
+    auto fail = [finish](size_t index, const string& error) {
+        BatchResult result;
+        result.diagnostic = error;
+        finish(index, std::move(result));
+    };
+
+    WorkStealingPool pool(options.threads);
+    pool.start();
+    // Files handed to the pool (or failed) so far; a fallback reader skips them.
+    vector<char> dispatched(sources.size(), 0);
+    auto startInMemory = [&](size_t index) {
+        dispatched[index] = 1;
+        pool.submit([&sources, check, index] { check(index, string_view(sources[index].data, sources[index].size)); });
+    };
+    bool anyOnDisk = any_of(sources.begin(), sources.end(), [](const SourceFile& source) { return !source.data; });
+    usedIoUring = false;
+#ifdef PROJECTCC_HAVE_IO_URING
+    if (options.useIoUring && anyOnDisk) {
+        try {
+            readSourcesWithIoUring(sources, order, sequencer, startInMemory, [&](size_t index, string contents, string error) {
+                dispatched[index] = 1;
+                if (!error.empty()) {
+                    fail(index, error);
+                    return;
+                }
+                pool.submit([check, index, code = std::move(contents)] { check(index, code); });
+            }, syscalls);
+            usedIoUring = true;
+        }
+        catch (const runtime_error&) {
+            // Setup, registration or a later submission failed; read whatever
+            // the ring had not delivered yet with read(2).
+        }
+    }
+#endif
+    if (!usedIoUring) {
+        for (size_t index : order) {
+            if (dispatched[index]) continue;
+            sequencer.waitForRoom(index);
+            if (sources[index].data) {
+                startInMemory(index);
+                continue;
+            }
+            pool.submit([&sources, &syscalls, check, fail, index] {
+                string code;
+                try {
+                    code = readWholeFile(sources[index].path, syscalls);
+                }
+                catch (const exception& e) {
+                    fail(index, e.what());
+                    return;
+                }
+                check(index, code);
+            });
+        }
+    }
+    pool.finish();
+}
+
+// Runs the whole batch and returns everything it would print, in order.
+string batchOutput(const vector<SourceFile>& sources, const BatchOptions& options) {
+    string out;
+    OutputSequencer sequencer(options.reorderWindow, [&out](size_t, const BatchResult& result) {
+        out += result.output;
+    });
+    atomic<size_t> syscalls(0);
+    bool usedIoUring;
+    checkSources(sources, options, sequencer, syscalls, usedIoUring);
+    return out;
+}
+
+// Multi-file driver: prints "path: ok" or "path: <diagnostic>" per file, in
+// input order and as soon as all earlier files are done, then a throughput and
+// syscall summary on stderr. With `scaling`, instead times the whole batch at
+// 1, 2, 4, ... up to `options.threads` threads and checks that every thread
+// count produced byte-identical output.
+int runBatch(const vector<string>& inputs, const BatchOptions& options, bool scaling) {
+    vector<SourceFile> sources = collectSources(inputs);
+    size_t totalBytes = 0;
+    for (const auto& source : sources) totalBytes += source.size;
+    double megabytes = totalBytes / (1024.0 * 1024.0);
+
+    if (scaling) {
+        double baseline = 0;
+        string expected;
+        bool identical = true;
+        for (size_t threads = 1; ; threads = min(threads * 2, options.threads)) {
+            BatchOptions run = options;
+            run.threads = threads;
+            auto start = chrono::steady_clock::now();
+            string output = batchOutput(sources, run);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (threads == 1) {
+                baseline = seconds;
+                expected = output;
+            }
+            identical = identical && output == expected;
+            cout << threads << " threads: " << sources.size() / seconds << " files/s, "
+                 << megabytes / seconds << " MB/s, speedup " << baseline / seconds << "x"
+                 << (output == expected ? "" : " [output differs from 1 thread]") << endl;
+            if (threads >= options.threads) break;
+        }
+        return identical ? 0 : 1;
+    }
+
+    int failures = 0;
+    OutputSequencer sequencer(options.reorderWindow, [&failures](size_t, const BatchResult& result) {
+        PhaseScope timing(OUTPUT_PHASE);
+        cout << result.output;
+        if (!result.ok) ++failures;
+    });
+    atomic<size_t> syscalls(0);
+    bool usedIoUring;
+    auto start = chrono::steady_clock::now();
+    checkSources(sources, options, sequencer, syscalls, usedIoUring);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout.flush();
+    cerr << sources.size() << " files (" << failures << " with errors), " << megabytes << " MB in "
+         << seconds * 1000 << " ms on " << options.threads << " threads: " << sources.size() / seconds
+         << " files/s, " << megabytes / seconds << " MB/s" << endl;
+    cerr << "Reads: " << (usedIoUring ? "io_uring" : "read(2) on worker threads") << ", " << syscalls.load()
+         << " syscalls (" << (sources.empty() ? 0.0 : double(syscalls.load()) / sources.size()) << " per file)" << endl;
+    if (options.parseCache) {
+        cerr << options.parseCache->statistics() << endl;
+    }
+    return failures ? 1 : 0;
+}
+
+// Parse result exchanged between farm workers and the coordinator and kept in
+// the shared cache. The parser does not build a tree yet, so the summary of a
+// parse is what gets serialized: "<ok>\n<statements>\n<tokens>\n<diagnostic>".
+struct ParseSummary {
+    bool ok = false;
+    size_t statements = 0;
+    size_t tokens = 0;
+    string diagnostic;
+
+    string serialize() const {
+        return string(ok ? "1" : "0") + "\n" + to_string(statements) + "\n" + to_string(tokens) + "\n" + diagnostic;
+    }
+
+    static ParseSummary deserialize(const string& data) {
+        ParseSummary summary;
+        istringstream in(data);
+        string ok;
+        in >> ok >> summary.statements >> summary.tokens;
+        in.ignore(1);
+        getline(in, summary.diagnostic, '\0');
+        summary.ok = ok == "1";
+        return summary;
+    }
+};
+
+// Checks `code` with diagnoseTokens(), so the farm reports what every other
+// mode reports; `diagnostic` is the first diagnostic.
+ParseSummary summarizeSource(string_view code) {
+    ParseSummary summary;
+    Lexer lexer(code);
+    vector<Token> tokens = lexer.tokenize();
+    summary.tokens = tokens.size();
+    vector<Diagnostic> diagnostics = diagnoseTokens(tokens, 0, nullptr, nullptr, [&] { ++summary.statements; });
+    summary.ok = diagnostics.empty();
+    if (!summary.ok) summary.diagnostic = diagnostics.front().render(tokens);
+    return summary;
+}
+
+// On-disk cache addressed by content key. Entries are written to a temporary
+// file and renamed, so several processes can share one directory.
+class ContentCache {
+public:
+    explicit ContentCache(const string& directory) : directory(directory) {
+        std::filesystem::create_directories(directory);
+    }
+
+    bool load(const string& key, string& value) const {
+        ifstream file(directory + "/" + key, ios::binary);
+        if (!file) return false;
+        stringstream contents;
+        contents << file.rdbuf();
+        value = contents.str();
+        return true;
+    }
+
+    void store(const string& key, const string& value) const {
+        string path = directory + "/" + key;
+        string temporary = path + ".tmp" + to_string(getpid()) + "-" + to_string(hash<thread::id>()(this_thread::get_id()));
+        {
+            ofstream file(temporary, ios::binary);
+            file.write(value.data(), value.size());
+            if (!file) return;
+        }
+        if (rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+        }
+    }
+
+private:
+    string directory;
+};
+
+string contentKey(string_view code) {
+    return hexHash(hashBytes(code.data(), code.size())) + "-" + to_string(code.size());
+}
+
+// Keys arrive from the network and name files in the cache directory, so only
+// the exact shape contentKey() produces is accepted: 16 hex digits, '-', digits.
+bool isContentKey(const string& key) {
+    if (key.size() < 18 || key.size() > 37 || key[16] != '-') return false;
+    for (size_t i = 0; i < 16; ++i) {
+        if (!isdigit(static_cast<unsigned char>(key[i])) && (key[i] < 'a' || key[i] > 'f')) return false;
+    }
+    for (size_t i = 17; i < key.size(); ++i) {
+        if (!isdigit(static_cast<unsigned char>(key[i]))) return false;
+    }
+    return true;
+}
+
+const size_t maxFarmSourceBytes = 64 << 20;
+
+int listenTcp(const string& host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (fd < 0 || inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1
+        || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        if (fd >= 0) ::close(fd);
+        throw runtime_error("Could not listen on " + host + ":" + to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+int boundPort(int fd) {
+    sockaddr_in address = {};
+    socklen_t length = sizeof(address);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+    return ntohs(address.sin_port);
+}
+
+int connectTcp(const string& host, int port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0 || !found) {
+        throw runtime_error("Could not resolve " + host);
+    }
+    int fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    bool connected = fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) == 0;
+    freeaddrinfo(found);
+    if (!connected) {
+        if (fd >= 0) ::close(fd);
+        throw runtime_error("Could not connect to " + host + ":" + to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Compile-farm worker. Per connection it answers:
+//   has KEY                      -> "hit N\n<N bytes>" or "miss"
+//   check KEY N\n<N source bytes> -> "result N\n<N bytes>"
+// where KEY is contentKey() of the source and the payload a serialized
+// ParseSummary. Results go to a ContentCache that workers on one machine share,
+// so a file parsed by any worker is a hit for all of them. The worker recomputes
+// KEY from the bytes it receives, so a client cannot store a result under some
+// other file's key; malformed requests get "error MESSAGE". Cache entries are
+// named by grammarVersion and checkerVersion as well, so a parser or checker
+// change starts a fresh cache.
+class FarmWorker {
+public:
+    FarmWorker(int listener, const string& cacheDir) : listener(listener), cache(cacheDir) {}
+
+    void serve() {
+        warmUp();
+        while (true) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            thread(&FarmWorker::serveConnection, this, client).detach();
+        }
+    }
+
+private:
+    void serveConnection(int client) {
+        SocketReader reader(client);
+        string line;
+        while (reader.readLine(line)) {
+            istringstream request(line);
+            string command, key;
+            size_t size = 0;
+            request >> command >> key >> size;
+            string payload;
+            if (!isContentKey(key)) {
+                sendAll(client, "error malformed key\n");
+                break;
+            }
+            string entry = key + ".g" + to_string(grammarVersion) + ".c" + to_string(checkerVersion);
+            if (command == "has") {
+                if (!cache.load(entry, payload)) {
+                    if (!sendAll(client, "miss\n")) break;
+                    continue;
+                }
+                if (!sendAll(client, "hit " + to_string(payload.size()) + "\n" + payload)) break;
+            }
+            else if (command == "check") {
+                if (size > maxFarmSourceBytes) {
+                    sendAll(client, "error source larger than " + to_string(maxFarmSourceBytes) + " bytes\n");
+                    break;
+                }
+                string code;
+                if (!reader.readBytes(size, code)) break;
+                if (contentKey(code) != key) {
+                    if (!sendAll(client, "error key does not match the source\n")) break;
+                    continue;
+                }
+                payload = summarizeSource(code).serialize();
+                cache.store(entry, payload);
+                if (!sendAll(client, "result " + to_string(payload.size()) + "\n" + payload)) break;
+            }
+            else {
+                break;
+            }
+        }
+        ::close(client);
+    }
+
+    int listener;
+    ContentCache cache;
+};
+
+struct FarmEndpoint {
+    string host;
+    int port;
+};
+
+// Parses "host:port,host:port".
+vector<FarmEndpoint> parseEndpoints(const string& list) {
+    vector<FarmEndpoint> endpoints;
+    stringstream in(list);
+    string item;
+    while (getline(in, item, ',')) {
+        size_t colon = item.rfind(':');
+        char* end = nullptr;
+        long port = colon == string::npos ? 0 : strtol(item.c_str() + colon + 1, &end, 10);
+        if (colon == string::npos || end == item.c_str() + colon + 1 || *end != '\0' || port <= 0 || port > 65535) {
+            throw runtime_error("Expected host:port, got " + item);
+        }
+        endpoints.push_back({ item.substr(0, colon), static_cast<int>(port) });
+    }
+    return endpoints;
+}
+
+// Coordinator: shards the sources over the workers by size (each file goes to
+// the worker with the fewest bytes assigned so far, largest files first), asks
+// each worker whether it already holds the result for the file's content key
+// and sends the source bytes only on a miss. Prints results in input order.
+int runCoordinator(const vector<FarmEndpoint>& endpoints, const vector<string>& inputs) {
+    vector<SourceFile> sources = collectSources(inputs);
+    vector<size_t> order(sources.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sources[a].size > sources[b].size; });
+    vector<vector<size_t>> shards(endpoints.size());
+    vector<size_t> load(endpoints.size(), 0);
+    for (size_t index : order) {
+        size_t target = min_element(load.begin(), load.end()) - load.begin();
+        shards[target].push_back(index);
+        load[target] += sources[index].size + 1;
+    }
+
+    vector<ParseSummary> results(sources.size());
+    atomic<size_t> hits(0);
+    atomic<size_t> bytesSent(0);
+    auto start = chrono::steady_clock::now();
+    vector<thread> connections;
+    for (size_t w = 0; w < endpoints.size(); ++w) {
+        connections.emplace_back([&, w] {
+            int fd = -1;
+            try {
+                fd = connectTcp(endpoints[w].host, endpoints[w].port);
+            }
+            catch (const exception& e) {
+                for (size_t index : shards[w]) results[index].diagnostic = e.what();
+                return;
+            }
+            SocketReader reader(fd);
+            atomic<size_t> unused(0);
+            for (size_t index : shards[w]) {
+                try {
+                    string code = sources[index].data ? string(sources[index].data, sources[index].size)
+                                                      : readWholeFile(sources[index].path, unused);
+                    string key = contentKey(code);
+                    string line;
+                    string payload;
+                    if (!sendAll(fd, "has " + key + "\n") || !reader.readLine(line)) {
+                        throw runtime_error("Lost connection to worker " + endpoints[w].host);
+                    }
+                    if (line.compare(0, 4, "hit ") == 0) {
+                        ++hits;
+                    }
+                    else if (line == "miss") {
+                        if (!sendAll(fd, "check " + key + " " + to_string(code.size()) + "\n" + code) || !reader.readLine(line)) {
+                            throw runtime_error("Lost connection to worker " + endpoints[w].host);
+                        }
+                        bytesSent += code.size();
+                    }
+                    if (line.compare(0, 6, "error ") == 0) {
+                        throw runtime_error("Worker " + endpoints[w].host + ": " + line.substr(6));
+                    }
+                    size_t size = stoul(line.substr(line.find(' ') + 1));
+                    if (!reader.readBytes(size, payload)) {
+                        throw runtime_error("Lost connection to worker " + endpoints[w].host);
+                    }
+                    results[index] = ParseSummary::deserialize(payload);
+                }
+                catch (const exception& e) {
+                    results[index].diagnostic = e.what();
+                }
+            }
+            ::close(fd);
+        });
+    }
+    for (auto& connection : connections) {
+        connection.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int failures = 0;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        cout << sources[i].path << ": " << (results[i].ok ? "ok" : results[i].diagnostic) << "\n";
+        if (!results[i].ok) ++failures;
+    }
+    cout.flush();
+    cerr << sources.size() << " files (" << failures << " with errors) on " << endpoints.size() << " workers in "
+         << seconds * 1000 << " ms; " << hits.load() << " cache hits, " << bytesSent.load() << " source bytes sent" << endl;
+    return failures ? 1 : 0;
+}
+
+// Owns forked worker processes: terminates and reaps them when it goes out of
+// scope, so an exception anywhere in the farm run does not leave them behind.
+class ChildProcesses {
+public:
+    ChildProcesses() = default;
+    ChildProcesses(const ChildProcesses&) = delete;
+    ChildProcesses& operator=(const ChildProcesses&) = delete;
+
+    ~ChildProcesses() {
+        for (pid_t child : children) kill(child, SIGTERM);
+        for (pid_t child : children) {
+            while (waitpid(child, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+    }
+
+    void add(pid_t pid) { children.push_back(pid); }
+
+private:
+    vector<pid_t> children;
+};
+
+// Starts `workerCount` worker processes on loopback ports, coordinates the
+// inputs across them and stops them again.
+int runLocalFarm(size_t workerCount, const string& cacheDir, const vector<string>& inputs) {
+    vector<FarmEndpoint> endpoints;
+    ChildProcesses children;
+    cout.flush();
+    for (size_t i = 0; i < workerCount; ++i) {
+        int listener = listenTcp("127.0.0.1", 0);
+        endpoints.push_back({ "127.0.0.1", boundPort(listener) });
+        pid_t pid = fork();
+        if (pid == 0) {
+            // The child must not unwind into the parent's guard and kill its siblings.
+            try {
+                FarmWorker(listener, cacheDir).serve();
+            }
+            catch (const exception& e) {
+                cerr << "Farm worker: " << e.what() << endl;
+                _exit(1);
+            }
+            _exit(0);
+        }
+        ::close(listener);
+        if (pid < 0) {
+            throw runtime_error(string("fork failed: ") + strerror(errno));
+        }
+        children.add(pid);
+    }
+    return runCoordinator(endpoints, inputs);
+}
+
+// Symbol index file: for every identifier, the files and lines where it is
+// declared or used. Records have fixed sizes and sit at fixed offsets, so a
+// lookup binary-searches the mapped file directly:
+//   IndexHeader | IndexedFile[fileCount] | IndexTerm[termCount], sorted by name
+//   | IndexPosting[postingCount], grouped by term | path and name text
+const uint32_t indexFormatVersion = 1;
+
+struct IndexHeader {
+    char magic[4];  // "PCX1"
+    uint32_t version;
+    uint32_t fileCount;
+    uint32_t termCount;
+    uint32_t postingCount;
+    uint32_t textOffset;
+};
+
+struct IndexedFile {
+    uint32_t pathOffset;
+    uint32_t pathLength;
+    uint64_t size;
+    int64_t modified;  // mtime in nanoseconds; 0 for archive members
+    uint64_t contentHash;
+};
+
+struct IndexTerm {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t firstPosting;
+    uint32_t postingCount;
+};
+
+// One occurrence of a term; `role` indexes indexRoles.
+struct IndexPosting {
+    uint32_t file;
+    int32_t line;
+    uint32_t role;
+};
+
+const char* const indexRoles[] = { "use", "int", "ifstream", "ofstream", "fstream" };
+
+// What the index records about one source file. IndexPosting::file is not
+// used here; it is assigned when the index is written.
+struct FileSymbols {
+    string path;
+    uint64_t size = 0;
+    int64_t modified = 0;
+    uint64_t contentHash = 0;
+    vector<pair<string, IndexPosting>> occurrences;
+};
+
+FileSymbols indexSource(const string& path, string_view code) {
+    FileSymbols file;
+    file.path = path;
+    file.size = code.size();
+    file.contentHash = hashBytes(code.data(), code.size());
+    vector<Token> tokens = Lexer(code).tokenize();
+    vector<uint32_t> roles(tokens.size(), 0);
+    for (const auto& declaration : collectDeclarations(tokens)) {
+        roles[declaration.token] = find(begin(indexRoles), end(indexRoles), declaration.type) - begin(indexRoles);
+    }
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].type == IDENTIFIER) {
+            file.occurrences.push_back({ tokens[i].value, { 0, tokens[i].line, roles[i] } });
+        }
+    }
+    return file;
+}
+
+void writeSymbolIndex(const string& path, const vector<FileSymbols>& files) {
+    PhaseScope timing(INDEX_PHASE);
+    map<string_view, vector<IndexPosting>> postingsByTerm;
+    for (uint32_t f = 0; f < files.size(); ++f) {
+        for (const auto& occurrence : files[f].occurrences) {
+            IndexPosting posting = occurrence.second;
+            posting.file = f;
+            postingsByTerm[occurrence.first].push_back(posting);
+        }
+    }
+
+    string text;
+    vector<IndexedFile> fileRecords;
+    for (const auto& file : files) {
+        fileRecords.push_back({ static_cast<uint32_t>(text.size()), static_cast<uint32_t>(file.path.size()),
+                                file.size, file.modified, file.contentHash });
+        text += file.path;
+    }
+    vector<IndexTerm> terms;
+    vector<IndexPosting> postings;
+    for (const auto& entry : postingsByTerm) {
+        terms.push_back({ static_cast<uint32_t>(text.size()), static_cast<uint32_t>(entry.first.size()),
+                          static_cast<uint32_t>(postings.size()), static_cast<uint32_t>(entry.second.size()) });
+        text += entry.first;
+        postings.insert(postings.end(), entry.second.begin(), entry.second.end());
+    }
+
+    IndexHeader header = {};
+    memcpy(header.magic, "PCX1", 4);
+    header.version = indexFormatVersion;
+    header.fileCount = static_cast<uint32_t>(fileRecords.size());
+    header.termCount = static_cast<uint32_t>(terms.size());
+    header.postingCount = static_cast<uint32_t>(postings.size());
+    header.textOffset = static_cast<uint32_t>(sizeof(header) + fileRecords.size() * sizeof(IndexedFile)
+                                              + terms.size() * sizeof(IndexTerm) + postings.size() * sizeof(IndexPosting));
+
+    string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(fileRecords.data()), fileRecords.size() * sizeof(IndexedFile));
+    out.append(reinterpret_cast<const char*>(terms.data()), terms.size() * sizeof(IndexTerm));
+    out.append(reinterpret_cast<const char*>(postings.data()), postings.size() * sizeof(IndexPosting));
+    out += text;
+
+    string temporary = path + ".tmp" + to_string(getpid());
+    DiskFileBackend().writeFile(temporary, out);
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        throw runtime_error("Could not write symbol index: " + path);
+    }
+}
+
+class SymbolIndex {
+public:
+    // Returns nullptr when the file is missing, not a symbol index of this
+    // format version, or has a record pointing outside its tables or text.
+    static unique_ptr<SymbolIndex> load(const string& path) {
+        if (access(path.c_str(), R_OK) != 0) {
+            return nullptr;
+        }
+        unique_ptr<MappedFile> file(new MappedFile(path));
+        if (file->size() < sizeof(IndexHeader)) {
+            return nullptr;
+        }
+        const IndexHeader* header = reinterpret_cast<const IndexHeader*>(file->data());
+        size_t tables = sizeof(IndexHeader) + size_t(header->fileCount) * sizeof(IndexedFile)
+                      + size_t(header->termCount) * sizeof(IndexTerm) + size_t(header->postingCount) * sizeof(IndexPosting);
+        if (memcmp(header->magic, "PCX1", 4) != 0 || header->version != indexFormatVersion
+            || header->textOffset != tables || tables > file->size()) {
+            return nullptr;
+        }
+        unique_ptr<SymbolIndex> index(new SymbolIndex(std::move(file)));
+        return index->valid() ? std::move(index) : nullptr;
+    }
+
+    struct Occurrence {
+        string_view path;
+        int line;
+        const char* role;
+    };
+
+    // Declarations and uses of `name`, ordered by file and line.
+    vector<Occurrence> lookup(string_view name) const {
+        const IndexTerm* end = terms + header->termCount;
+        const IndexTerm* term = lower_bound(terms, end, name, [this](const IndexTerm& entry, string_view key) {
+            return text(entry.nameOffset, entry.nameLength) < key;
+        });
+        vector<Occurrence> out;
+        if (term == end || text(term->nameOffset, term->nameLength) != name) {
+            return out;
+        }
+        for (uint32_t i = 0; i < term->postingCount; ++i) {
+            const IndexPosting& posting = postings[term->firstPosting + i];
+            const IndexedFile& file = files[posting.file];
+            out.push_back({ text(file.pathOffset, file.pathLength), posting.line, indexRoles[posting.role] });
+        }
+        return out;
+    }
+
+    size_t fileCount() const {
+        return header->fileCount;
+    }
+
+    size_t termCount() const {
+        return header->termCount;
+    }
+
+    // Turns the inverted index back into per-file records, so an update can
+    // carry unchanged files over without reading them.
+    map<string, FileSymbols> fileSymbols() const {
+        vector<FileSymbols> byIndex(header->fileCount);
+        for (uint32_t f = 0; f < header->fileCount; ++f) {
+            byIndex[f].path = string(text(files[f].pathOffset, files[f].pathLength));
+            byIndex[f].size = files[f].size;
+            byIndex[f].modified = files[f].modified;
+            byIndex[f].contentHash = files[f].contentHash;
+        }
+        for (uint32_t t = 0; t < header->termCount; ++t) {
+            string name(text(terms[t].nameOffset, terms[t].nameLength));
+            for (uint32_t i = 0; i < terms[t].postingCount; ++i) {
+                const IndexPosting& posting = postings[terms[t].firstPosting + i];
+                byIndex[posting.file].occurrences.push_back({ name, posting });
+            }
+        }
+        map<string, FileSymbols> out;
+        for (auto& file : byIndex) {
+            string path = file.path;
+            out[path] = std::move(file);
+        }
+        return out;
+    }
+
+private:
+    explicit SymbolIndex(unique_ptr<MappedFile> mapped)
+        : file(std::move(mapped)),
+          header(reinterpret_cast<const IndexHeader*>(file->data())),
+          files(reinterpret_cast<const IndexedFile*>(file->data() + sizeof(IndexHeader))),
+          terms(reinterpret_cast<const IndexTerm*>(files + header->fileCount)),
+          postings(reinterpret_cast<const IndexPosting*>(terms + header->termCount)) {}
+
+    // Checked once at load so lookups can index the tables without checks.
+    bool valid() const {
+        size_t textSize = file->size() - header->textOffset;
+        auto inText = [textSize](uint32_t offset, uint32_t length) { return size_t(offset) + length <= textSize; };
+        for (uint32_t f = 0; f < header->fileCount; ++f) {
+            if (!inText(files[f].pathOffset, files[f].pathLength)) return false;
+        }
+        for (uint32_t t = 0; t < header->termCount; ++t) {
+            if (!inText(terms[t].nameOffset, terms[t].nameLength)
+                || size_t(terms[t].firstPosting) + terms[t].postingCount > header->postingCount) {
+                return false;
+            }
+        }
+        for (uint32_t p = 0; p < header->postingCount; ++p) {
+            if (postings[p].file >= header->fileCount || postings[p].role >= size(indexRoles)) return false;
+        }
+        return true;
+    }
+
+    string_view text(uint32_t offset, uint32_t length) const {
+        return string_view(file->data() + header->textOffset + offset, length);
+    }
+
+    unique_ptr<MappedFile> file;
+    const IndexHeader* header;
+    const IndexedFile* files;
+    const IndexTerm* terms;
+    const IndexPosting* postings;
+};
+
+// Brings the index at `indexPath` up to date with `inputs`. Files whose size
+// and mtime (or, for archive members, content hash) match the old index keep
+// their records; only new and changed files are lexed, on `threads` threads.
+// Indexed files that `inputs` do not name are carried over as long as they
+// still exist, so updating one file keeps the rest of the index.
+void updateSymbolIndex(const string& indexPath, const vector<string>& inputs, size_t threads) {
+    auto start = chrono::steady_clock::now();
+    vector<SourceFile> sources = collectSources(inputs);
+    map<string, FileSymbols> previous;
+    if (auto old = SymbolIndex::load(indexPath)) {
+        previous = old->fileSymbols();
+    }
+
+    vector<FileSymbols> files(sources.size());
+    vector<bool> failed(sources.size(), false);
+    vector<function<void()>> tasks;
+    size_t reused = 0;
+    set<string> scannedArchives;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        const SourceFile& source = sources[i];
+        if (source.data) {
+            scannedArchives.insert(source.path.substr(0, source.path.find(".tar:") + 4));
+        }
+        int64_t modified = 0;
+        uint64_t contentHash = 0;
+        struct stat info;
+        if (source.data) {
+            contentHash = hashBytes(source.data, source.size);
+        }
+        else if (stat(source.path.c_str(), &info) == 0) {
+            modified = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        }
+        auto it = previous.find(source.path);
+        if (it != previous.end()) {
+            FileSymbols old = std::move(it->second);
+            previous.erase(it);
+            if (old.size == source.size
+                && (source.data ? old.contentHash == contentHash : modified != 0 && old.modified == modified)) {
+                files[i] = std::move(old);
+                ++reused;
+                continue;
+            }
+        }
+        tasks.push_back([&sources, &files, &failed, i, modified] {
+            TraceScope trace("index file", "file", sources[i].path);
+            try {
+                if (sources[i].data) {
+                    files[i] = indexSource(sources[i].path, string_view(sources[i].data, sources[i].size));
+                }
+                else {
+                    atomic<size_t> unused(0);
+                    files[i] = indexSource(sources[i].path, readWholeFile(sources[i].path, unused));
+                    files[i].modified = modified;
+                }
+            }
+            catch (const exception&) {
+                failed[i] = true;
+            }
+        });
+    }
+    size_t reindexed = tasks.size();
+    WorkStealingPool(threads).run(std::move(tasks));
+
+    vector<FileSymbols> indexed;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (failed[i]) {
+            cerr << "Could not index " << sources[i].path << endl;
+            --reindexed;
+            continue;
+        }
+        indexed.push_back(std::move(files[i]));
+    }
+    // What is left of `previous` was not named this run. A member goes with its
+    // archive, or when the archive was rescanned and no longer holds it.
+    size_t carried = 0;
+    size_t dropped = 0;
+    for (auto& entry : previous) {
+        const string& path = entry.first;
+        size_t member = entry.second.modified == 0 ? path.find(".tar:") : string::npos;
+        string onDisk = member == string::npos ? path : path.substr(0, member + 4);
+        struct stat info;
+        if (stat(onDisk.c_str(), &info) != 0 || (member != string::npos && scannedArchives.count(onDisk))) {
+            ++dropped;
+            continue;
+        }
+        indexed.push_back(std::move(entry.second));
+        ++carried;
+    }
+    writeSymbolIndex(indexPath, indexed);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cerr << "Indexed " << indexed.size() << " files (" << reused << " unchanged, " << reindexed << " lexed, "
+         << carried << " not named, " << dropped << " dropped) in " << ms << " ms" << endl;
+}
+
+// Prints every declaration and use of each name, with the lookup time.
+int lookupSymbols(const string& indexPath, const vector<string>& names) {
+    auto index = SymbolIndex::load(indexPath);
+    if (!index) {
+        throw runtime_error("No valid symbol index at " + indexPath);
+    }
+    int status = 0;
+    for (const auto& name : names) {
+        auto start = chrono::steady_clock::now();
+        vector<SymbolIndex::Occurrence> occurrences = index->lookup(name);
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        for (const auto& occurrence : occurrences) {
+            cout << occurrence.path << ":" << occurrence.line << ": "
+                 << (strcmp(occurrence.role, "use") == 0 ? string("use of ") : string("declares ") + occurrence.role + " ")
+                 << name << "\n";
+        }
+        cout.flush();
+        cerr << occurrences.size() << " occurrences of " << name << " in " << index->fileCount() << " files, "
+             << index->termCount() << " names: " << us << " us" << endl;
+        if (occurrences.empty()) status = 1;
+    }
+    return status;
+}
+
+// Structural query over a SyntaxTree:
+//   pattern    := kind constraint*
+//   constraint := field=value                the node's field equals value
+//               | field=$var                 binds $var, or must equal it
+//               | contains(pattern)          some node of the subtree matches
+//               | nowhere(pattern)           no node of the file matches
+// Kinds are nodeKindNames; fields are name, type, method and value. Variables
+// bound by the outer pattern constrain the inner ones, so
+//   filedecl type=ofstream name=$f nowhere(fileop name=$f method=close)
+// finds output files that are never closed.
+struct TreePattern {
+    NodeKind kind = PROGRAM_NODE;
+    vector<pair<string, string>> fields;
+    vector<TreePattern> contains;
+    vector<TreePattern> nowhere;
+
+    static TreePattern parse(const string& text) {
+        vector<string> words;
+        for (size_t i = 0; i < text.size(); ) {
+            if (isspace(static_cast<unsigned char>(text[i]))) {
+                ++i;
+            }
+            else if (strchr("()=", text[i])) {
+                words.push_back(string(1, text[i++]));
+            }
+            else {
+                size_t end = text.find_first_of(" \t()=", i);
+                end = end == string::npos ? text.size() : end;
+                words.push_back(text.substr(i, end - i));
+                i = end;
+            }
+        }
+        size_t position = 0;
+        TreePattern pattern = parseWords(words, position);
+        if (position != words.size()) {
+            throw runtime_error("Unexpected '" + words[position] + "' in query: " + text);
+        }
+        return pattern;
+    }
+
+    static const string* field(const SyntaxNode& node, const string& name) {
+        if (name == "name") return &node.name;
+        if (name == "type") return &node.type;
+        if (name == "method") return &node.method;
+        if (name == "value") return &node.value;
+        return nullptr;
+    }
+
+private:
+    static TreePattern parseWords(const vector<string>& words, size_t& position) {
+        if (position >= words.size()) {
+            throw runtime_error("Query ends where a node kind was expected");
+        }
+        TreePattern pattern;
+        const string& kind = words[position++];
+        auto known = find(begin(nodeKindNames), end(nodeKindNames), kind);
+        if (known == end(nodeKindNames)) {
+            throw runtime_error("Unknown node kind in query: " + kind);
+        }
+        pattern.kind = static_cast<NodeKind>(known - begin(nodeKindNames));
+        while (position < words.size() && words[position] != ")") {
+            const string& word = words[position++];
+            if (word == "contains" || word == "nowhere") {
+                if (position >= words.size() || words[position++] != "(") {
+                    throw runtime_error("Expected '(' after " + word + " in query");
+                }
+                (word == "contains" ? pattern.contains : pattern.nowhere).push_back(parseWords(words, position));
+                if (position >= words.size() || words[position++] != ")") {
+                    throw runtime_error("Expected ')' to close " + word + " in query");
+                }
+            }
+            else {
+                SyntaxNode probe = {};
+                if (!field(probe, word) || position + 1 >= words.size() || words[position] != "=") {
+                    throw runtime_error("Expected field=value in query, got " + word);
+                }
+                pattern.fields.push_back({ word, words[position + 1] });
+                position += 2;
+            }
+        }
+        return pattern;
+    }
+};
+
+// Runs patterns against one tree. Only nodes of the pattern's kind are tried,
+// taken from the tree's per-kind lists; contains() looks only at the run of
+// that list that falls inside the subtree.
+class TreeMatcher {
+public:
+    explicit TreeMatcher(const SyntaxTree& tree) : tree(tree) {}
+
+    vector<uint32_t> run(const TreePattern& pattern) {
+        PhaseScope timing(QUERY_PHASE);
+        vector<uint32_t> matches;
+        for (uint32_t id : tree.byKind[pattern.kind]) {
+            map<string, string> bindings;
+            if (matchNode(pattern, id, bindings)) matches.push_back(id);
+        }
+        return matches;
+    }
+
+    size_t nodesExamined() const {
+        return examined;
+    }
+
+private:
+    bool matchNode(const TreePattern& pattern, uint32_t id, map<string, string>& bindings) {
+        ++examined;
+        const SyntaxNode& node = tree.nodes[id];
+        for (const auto& constraint : pattern.fields) {
+            const string& actual = *TreePattern::field(node, constraint.first);
+            if (constraint.second[0] != '$') {
+                if (actual != constraint.second) return false;
+                continue;
+            }
+            auto bound = bindings.emplace(constraint.second, actual);
+            if (!bound.second && bound.first->second != actual) return false;
+        }
+        for (const auto& inner : pattern.contains) {
+            const vector<uint32_t>& candidates = tree.byKind[inner.kind];
+            auto first = upper_bound(candidates.begin(), candidates.end(), id);
+            auto last = lower_bound(first, candidates.end(), node.end);
+            bool found = false;
+            for (auto it = first; it != last && !found; ++it) {
+                map<string, string> trial = bindings;
+                if (matchNode(inner, *it, trial)) {
+                    bindings = std::move(trial);
+                    found = true;
+                }
+            }
+            if (!found) return false;
+        }
+        for (const auto& inner : pattern.nowhere) {
+            for (uint32_t candidate : tree.byKind[inner.kind]) {
+                map<string, string> trial = bindings;
+                if (matchNode(inner, candidate, trial)) return false;
+            }
+        }
+        return true;
+    }
+
+    const SyntaxTree& tree;
+    size_t examined = 0;
+};
+
+struct TreeQuery {
+    string label;
+    TreePattern pattern;
+};
+
+// Each line is a pattern paired with whether it came from a query file. File
+// lines are "label: pattern" or just "pattern" (then labelled by its own
+// text), and blank lines and lines starting with '#' are skipped; a --query
+// pattern is always labelled by its own text, whatever it contains.
+vector<TreeQuery> loadTreeQueries(const vector<pair<string, bool>>& lines) {
+    vector<TreeQuery> queries;
+    for (const auto& [line, fromFile] : lines) {
+        if (!fromFile) {
+            queries.push_back({ line, TreePattern::parse(line) });
+            continue;
+        }
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#') continue;
+        size_t colon = line.find(':');
+        string label = colon == string::npos ? line.substr(start) : line.substr(start, colon - start);
+        queries.push_back({ label, TreePattern::parse(colon == string::npos ? line : line.substr(colon + 1)) });
+    }
+    return queries;
+}
+
+// Batch mode: parses every source once into a SyntaxTree and runs all
+// queries against it, on `threads` threads. Prints "path:line: label" per
+// match in input order; files that do not parse are counted and skipped.
+int runTreeQueries(const vector<string>& inputs, const vector<TreeQuery>& queries, size_t threads) {
+    auto start = chrono::steady_clock::now();
+    vector<SourceFile> sources = collectSources(inputs);
+    vector<string> outputs(sources.size());
+    vector<vector<size_t>> matchCounts(sources.size(), vector<size_t>(queries.size(), 0));
+    atomic<size_t> unparsed(0);
+    atomic<size_t> nodes(0);
+    atomic<size_t> examined(0);
+    vector<function<void()>> tasks;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        tasks.push_back([&, i] {
+            TraceScope trace("query file", "file", sources[i].path);
+            SyntaxTree tree;
+            try {
+                atomic<size_t> unused(0);
+                string code = sources[i].data ? string(sources[i].data, sources[i].size)
+                                              : readWholeFile(sources[i].path, unused);
+                vector<Token> tokens = Lexer(code).tokenize();
+                Parser parser(tokens);
+                parser.setSyntaxTree(&tree);
+                parser.parse();
+            }
+            catch (const exception&) {
+                ++unparsed;
+                return;
+            }
+            TreeMatcher matcher(tree);
+            for (size_t q = 0; q < queries.size(); ++q) {
+                for (uint32_t id : matcher.run(queries[q].pattern)) {
+                    outputs[i] += sources[i].path + ":" + to_string(tree.nodes[id].line) + ": " + queries[q].label + "\n";
+                    ++matchCounts[i][q];
+                }
+            }
+            nodes += tree.nodes.size();
+            examined += matcher.nodesExamined();
+        });
+    }
+    WorkStealingPool(threads).run(std::move(tasks));
+
+    {
+        PhaseScope timing(OUTPUT_PHASE);
+        for (const auto& output : outputs) {
+            cout << output;
+        }
+        cout.flush();
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cerr << sources.size() << " files (" << unparsed.load() << " did not parse), " << nodes.load() << " nodes; "
+         << queries.size() << " queries examined " << examined.load() << " nodes in " << ms << " ms" << endl;
+    size_t total = 0;
+    for (size_t q = 0; q < queries.size(); ++q) {
+        size_t count = 0;
+        for (const auto& counts : matchCounts) count += counts[q];
+        total += count;
+        cerr << "  " << count << " x " << queries[q].label << endl;
+    }
+    return total ? 0 : 1;
+}
+
+// --watch: checks every source the inputs expand to, the way batch mode does,
+// then re-checks only what inotify reports as written, created or moved in.
+// Results live in a QueryEngine, so an edit that leaves a file's tokens
+// unchanged (spacing within a line) is cut off before the parse and check run
+// again. A rewritten archive input has its members re-read; a changed @list,
+// or a lost event queue (IN_Q_OVERFLOW), expands all the inputs again.
+// Events are collected until the queue has been quiet for `settleMs`, so an
+// editor's write-temp-then-rename save is handled as one update.
+class SourceWatcher {
+public:
+    explicit SourceWatcher(const vector<string>& roots) : roots(roots), inotify(inotify_init1(IN_CLOEXEC)) {
+        if (inotify < 0) {
+            throw runtime_error(string("inotify_init1 failed: ") + strerror(errno));
+        }
+    }
+
+    ~SourceWatcher() {
+        ::close(inotify);
+    }
+
+    void run() {
+        rescan();
+        cout.flush();
+        cerr << "Watching " << files.size() << " files in " << directories.size() << " directories" << endl;
+
+        while (true) {
+            Update update;
+            if (!readEvents(update)) continue;
+            // Latency is measured from the first event of the update.
+            auto received = chrono::steady_clock::now();
+            pollfd pending = { inotify, POLLIN, 0 };
+            while (poll(&pending, 1, settleMs) > 0) {
+                readEvents(update);
+            }
+
+            size_t changed = 0;
+            size_t dropped = 0;
+            if (update.rescan) {
+                pair<size_t, size_t> counts = rescan();
+                changed = counts.first;
+                dropped = counts.second;
+            }
+            else {
+                for (const auto& path : update.removed) {
+                    dropped += forget(path);
+                }
+                for (const auto& archive : update.archives) {
+                    pair<size_t, size_t> counts = recheckArchive(archive);
+                    changed += counts.first;
+                    dropped += counts.second;
+                }
+                for (const auto& path : update.changed) {
+                    files.insert(path);
+                    recheck(SourceFile{ path, 0, nullptr, nullptr });
+                    ++changed;
+                }
+            }
+            if (changed == 0 && dropped == 0) continue;
+            cout.flush();
+            double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - received).count();
+            latencies.push_back(latency);
+            cerr << changed << " changed, " << dropped << " removed" << (update.rescan ? " (full rescan)" : "") << ": "
+                 << latency << " ms from event to diagnostics (p50 " << percentile(latencies, 0.50)
+                 << " ms, p99 " << percentile(latencies, 0.99) << " ms over " << latencies.size() << " updates)" << endl;
+            cerr << queries.statistics() << endl;
+        }
+    }
+
+    static constexpr int settleMs = 2;
+
+private:
+    struct Update {
+        set<string> changed;   // Files to re-read from disk
+        set<string> removed;   // Files, or archive members, that went away
+        set<string> archives;  // Archive inputs that were rewritten
+        bool rescan = false;   // Expand every input again
+    };
+
+    // Paths as recorded here: lexically normal, with an archive member keeping
+    // its "archive.tar:" prefix, so event paths and collected paths compare.
+    static string normalPath(const string& path) {
+        size_t member = path.find(".tar:");
+        if (member == string::npos) return std::filesystem::path(path).lexically_normal().string();
+        return std::filesystem::path(path.substr(0, member + 4)).lexically_normal().string() + path.substr(member + 4);
+    }
+
+    static bool isArchive(const string& path) {
+        return path.size() > 4 && path.compare(path.size() - 4, 4, ".tar") == 0;
+    }
+
+    // Hands the source's current text to the query engine and prints what
+    // check() reports for it.
+    void recheck(const SourceFile& source) {
+        string path = normalPath(source.path);
+        string code;
+        try {
+            code = source.data ? string(source.data, source.size) : DiskFileBackend().readFile(path);
+        }
+        catch (const runtime_error& e) {
+            queries.removeSource(path);
+            cout << path << ": " << e.what() << "\n";
+            return;
+        }
+        queries.setSource(path, std::move(code));
+        vector<string> diagnostics = queries.diagnostics(path);
+        if (diagnostics.empty()) {
+            cout << path << ": ok" << "\n";
+        }
+        for (const auto& diagnostic : diagnostics) {
+            cout << path << ": " << diagnostic << "\n";
+        }
+    }
+
+    size_t forget(const string& path) {
+        if (!files.erase(path)) return 0;
+        queries.removeSource(path);
+        cout << path << ": removed" << "\n";
+        return 1;
+    }
+
+    // Re-expands every input through collectSources, as batch mode would,
+    // re-establishes the watches and re-checks everything it finds. Returns
+    // how many sources were checked and how many disappeared.
+    pair<size_t, size_t> rescan() {
+        set<string> previous = std::move(files);
+        files.clear();
+        size_t checked = 0;
+        for (const auto& root : roots) {
+            try {
+                watchInputs({ root });
+            }
+            catch (const exception& e) {
+                cerr << e.what() << endl;
+            }
+            vector<SourceFile> sources;
+            try {
+                sources = collectSources({ root });
+            }
+            catch (const exception& e) {
+                cout << root << ": " << e.what() << "\n";
+                continue;
+            }
+            for (const auto& source : sources) {
+                string path = normalPath(source.path);
+                previous.erase(path);
+                files.insert(path);
+                recheck(source);
+                ++checked;
+            }
+        }
+        size_t dropped = 0;
+        for (const auto& path : previous) {
+            files.insert(path);
+            dropped += forget(path);
+        }
+        return { checked, dropped };
+    }
+
+    // Re-reads the members of a rewritten archive input.
+    pair<size_t, size_t> recheckArchive(const string& archive) {
+        set<string> previous;
+        string prefix = archive + ":";
+        for (auto it = files.lower_bound(prefix); it != files.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+            previous.insert(*it);
+        }
+        size_t checked = 0;
+        try {
+            for (const auto& member : tarMembers(archive)) {
+                string path = normalPath(member.path);
+                previous.erase(path);
+                files.insert(path);
+                recheck(member);
+                ++checked;
+            }
+        }
+        catch (const exception& e) {
+            cout << archive << ": " << e.what() << "\n";
+        }
+        size_t dropped = 0;
+        for (const auto& path : previous) dropped += forget(path);
+        return { checked, dropped };
+    }
+
+    // Reads one batch of events into `update`. Returns false when interrupted.
+    bool readEvents(Update& update) {
+        alignas(inotify_event) char buffer[64 * 1024];
+        ssize_t length = read(inotify, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR) return false;
+            throw runtime_error(string("inotify read failed: ") + strerror(errno));
+        }
+        for (ssize_t offset = 0; offset < length; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                update.rescan = true;
+                continue;
+            }
+            auto directory = directories.find(event->wd);
+            if (directory == directories.end()) continue;
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // The watched directory itself is gone or moved (its parent may
+                // not be watched, so this can be the only notice).
+                forgetDirectory(string(directory->second), update);
+                continue;
+            }
+            if (event->len == 0) continue;
+            string path = (std::filesystem::path(directory->second) / event->name).lexically_normal().string();
+            bool gone = event->mask & (IN_DELETE | IN_MOVED_FROM);
+            bool written = event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (listFiles.count(path)) {
+                update.rescan = update.rescan || gone || written;
+            }
+            else if (event->mask & IN_ISDIR) {
+                if (gone) {
+                    forgetDirectory(path, update);
+                }
+                else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && treeDirectories.count(directory->second)) {
+                    watchTree(path);
+                    for (const auto& source : collectSources({ path })) {
+                        update.changed.insert(normalPath(source.path));
+                    }
+                }
+            }
+            else if (archives.count(path)) {
+                if (gone) {
+                    string prefix = path + ":";
+                    for (auto it = files.lower_bound(prefix); it != files.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+                        update.removed.insert(*it);
+                    }
+                    update.archives.erase(path);
+                }
+                else if (written) {
+                    update.archives.insert(path);
+                }
+            }
+            else if (gone) {
+                update.removed.insert(path);
+                update.changed.erase(path);
+            }
+            else if (written && watched(path)) {
+                update.changed.insert(path);
+                update.removed.erase(path);
+            }
+        }
+        return true;
+    }
+
+    // Drops the watches on `root` and everything below it, and marks the files
+    // that lived there as removed.
+    void forgetDirectory(const string& root, Update& update) {
+        string prefix = root + "/";
+        for (auto it = directories.begin(); it != directories.end(); ) {
+            if (it->second == root || it->second.compare(0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(inotify, it->first);  // Fails harmlessly once the kernel dropped it
+                treeDirectories.erase(it->second);
+                it = directories.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for (auto it = files.lower_bound(prefix); it != files.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+            update.removed.insert(*it);
+            update.changed.erase(*it);
+        }
+    }
+
+    bool watched(const string& path) const {
+        if (files.count(path) || explicitFiles.count(path)) return true;
+        string parent = std::filesystem::path(path).parent_path().string();
+        return treeDirectories.count(parent) > 0 && isSourcePath(path);
+    }
+
+    // Watches what collectSources would read for `inputs`: directory trees,
+    // the directories holding single files and archives, and @list files
+    // together with everything they list.
+    void watchInputs(const vector<string>& inputs) {
+        namespace fs = std::filesystem;
+        for (const auto& input : inputs) {
+            if (!input.empty() && input[0] == '@') {
+                string list = normalPath(input.substr(1));
+                watchParent(list);
+                listFiles.insert(list);
+                ifstream in(list);
+                vector<string> listed;
+                string line;
+                while (getline(in, line)) {
+                    if (!line.empty()) listed.push_back(line);
+                }
+                watchInputs(listed);
+            }
+            else if (fs::is_directory(input)) {
+                watchTree(input);
+            }
+            else {
+                string path = normalPath(input);
+                watchParent(path);
+                explicitFiles.insert(path);
+                if (isArchive(path)) archives.insert(path);
+            }
+        }
+    }
+
+    void watchParent(const string& path) {
+        string parent = std::filesystem::path(path).parent_path().string();
+        watchDirectory(parent.empty() ? "." : parent);
+    }
+
+    void watchDirectory(const string& directory) {
+        int wd = inotify_add_watch(inotify, directory.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE
+                                   | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+            throw runtime_error("Could not watch " + directory + ": " + strerror(errno));
+        }
+        directories[wd] = directory;
+    }
+
+    void watchTree(const string& root) {
+        namespace fs = std::filesystem;
+        vector<string> entered;
+        walkSourceTree(fs::path(root).lexically_normal().string(), &entered);
+        for (const auto& directory : entered) {
+            watchDirectory(directory);
+            treeDirectories.insert(directory);
+        }
+    }
+
+    vector<string> roots;
+    int inotify;
+    map<int, string> directories;
+    set<string> treeDirectories;
+    set<string> explicitFiles;
+    set<string> listFiles;
+    set<string> archives;
+    set<string> files;
+    QueryEngine queries;
+    vector<double> latencies;
+};
+
+// Just enough JSON for the language server: requests are parsed into a tree
+// of values, and dump() writes a value back out (used to echo request ids).
+struct JsonValue {
+    enum Kind { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+    Kind kind = NUL;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> fields;
+
+    // Missing members read as null, so lookups can be chained.
+    const JsonValue& operator[](const string& key) const {
+        static const JsonValue missing;
+        for (const auto& field : fields) {
+            if (field.first == key) return field.second;
+        }
+        return missing;
+    }
+
+    int asInt(int fallback = 0) const {
+        return kind == NUMBER ? static_cast<int>(number) : fallback;
+    }
+
+    string dump() const {
+        switch (kind) {
+            case BOOLEAN: return boolean ? "true" : "false";
+            case NUMBER: {
+                ostringstream out;
+                out.precision(17);
+                out << number;
+                return out.str();
+            }
+            case STRING: return "\"" + jsonEscape(text) + "\"";
+            case ARRAY: {
+                string out = "[";
+                for (size_t i = 0; i < items.size(); ++i) {
+                    out += (i ? "," : "") + items[i].dump();
+                }
+                return out + "]";
+            }
+            case OBJECT: {
+                string out = "{";
+                for (size_t i = 0; i < fields.size(); ++i) {
+                    out += (i ? ",\"" : "\"") + jsonEscape(fields[i].first) + "\":" + fields[i].second.dump();
+                }
+                return out + "}";
+            }
+            default: return "null";
+        }
+    }
+
+    static JsonValue parse(string_view json) {
+        size_t position = 0;
+        JsonValue value = parseValue(json, position);
+        skipSpace(json, position);
+        if (position != json.size()) {
+            throw runtime_error("Unexpected data after JSON value");
+        }
+        return value;
+    }
+
+private:
+    static void skipSpace(string_view json, size_t& position) {
+        while (position < json.size() && strchr(" \t\r\n", json[position])) ++position;
+    }
+
+    static void expect(string_view json, size_t& position, char c) {
+        skipSpace(json, position);
+        if (position >= json.size() || json[position] != c) {
+            throw runtime_error(string("Expected '") + c + "' in JSON at offset " + to_string(position));
+        }
+        ++position;
+    }
+
+    static JsonValue parseValue(string_view json, size_t& position) {
+        skipSpace(json, position);
+        if (position >= json.size()) {
+            throw runtime_error("Unexpected end of JSON");
+        }
+        JsonValue value;
+        char c = json[position];
+        if (c == '{') {
+            value.kind = OBJECT;
+            ++position;
+            skipSpace(json, position);
+            if (position < json.size() && json[position] == '}') {
+                ++position;
+                return value;
+            }
+            do {
+                skipSpace(json, position);
+                string key = parseString(json, position);
+                expect(json, position, ':');
+                value.fields.emplace_back(std::move(key), parseValue(json, position));
+                skipSpace(json, position);
+            } while (position < json.size() && json[position] == ',' && ++position);
+            expect(json, position, '}');
+        }
+        else if (c == '[') {
+            value.kind = ARRAY;
+            ++position;
+            skipSpace(json, position);
+            if (position < json.size() && json[position] == ']') {
+                ++position;
+                return value;
+            }
+            do {
+                value.items.push_back(parseValue(json, position));
+                skipSpace(json, position);
+            } while (position < json.size() && json[position] == ',' && ++position);
+            expect(json, position, ']');
+        }
+        else if (c == '"') {
+            value.kind = STRING;
+            value.text = parseString(json, position);
+        }
+        else if (json.compare(position, 4, "true") == 0 || json.compare(position, 5, "false") == 0) {
+            value.kind = BOOLEAN;
+            value.boolean = c == 't';
+            position += value.boolean ? 4 : 5;
+        }
+        else if (json.compare(position, 4, "null") == 0) {
+            position += 4;
+        }
+        else {
+            size_t end = position;
+            while (end < json.size() && strchr("+-0123456789.eE", json[end])) ++end;
+            if (end == position) {
+                throw runtime_error("Unexpected character in JSON at offset " + to_string(position));
+            }
+            value.kind = NUMBER;
+            value.number = stod(string(json.substr(position, end - position)));
+            position = end;
+        }
+        return value;
+    }
+
+    static string parseString(string_view json, size_t& position) {
+        if (position >= json.size() || json[position] != '"') {
+            throw runtime_error("Expected string in JSON at offset " + to_string(position));
+        }
+        string out;
+        for (++position; position < json.size() && json[position] != '"'; ++position) {
+            char c = json[position];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (++position >= json.size()) break;
+            switch (json[position]) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    unsigned code = hexQuad(json, position);
+                    if (code >= 0xd800 && code < 0xdc00 && json.compare(position + 1, 2, "\\u") == 0) {
+                        position += 2;
+                        code = 0x10000 + ((code - 0xd800) << 10) + (hexQuad(json, position) - 0xdc00);
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default: out += json[position];
+            }
+        }
+        if (position >= json.size()) {
+            throw runtime_error("Unterminated string in JSON");
+        }
+        ++position;
+        return out;
+    }
+
+    // Reads the four hex digits after "\u" at `position`, leaving `position`
+    // on the last digit.
+    static unsigned hexQuad(string_view json, size_t& position) {
+        if (position + 4 >= json.size()) {
+            throw runtime_error("Truncated \\u escape in JSON");
+        }
+        unsigned code = stoul(string(json.substr(position + 1, 4)), nullptr, 16);
+        position += 4;
+        return code;
+    }
+
+    static void appendUtf8(string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            out += static_cast<char>(0xc0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000) {
+            out += static_cast<char>(0xe0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else {
+            out += static_cast<char>(0xf0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+};
+
+// LSP positions count UTF-16 code units; documents are stored as UTF-8.
+size_t utf8Offset(const string& line, int utf16Units) {
+    size_t offset = 0;
+    for (int units = 0; offset < line.size() && units < utf16Units; ++units) {
+        unsigned char lead = line[offset];
+        size_t width = lead < 0x80 ? 1 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+        if (width == 4) ++units;
+        offset = min(line.size(), offset + width);
+    }
+    return offset;
+}
+
+int utf16Length(string_view text) {
+    int units = 0;
+    for (unsigned char c : text) {
+        if ((c & 0xc0) != 0x80) units += c >= 0xf0 ? 2 : 1;
+    }
+    return units;
+}
+
+// Language server over stdio (JSON-RPC with Content-Length framing). Open
+// documents are kept as lines with each line's tokens; literals cannot span
+// lines, so an incremental didChange re-lexes only the lines it touches and
+// splices their tokens in. Diagnostics are computed on a background thread
+// once a document has been quiet for `debounceMs`; an edit cancels the parse
+// of any older version still running. Request latency and edit-to-diagnostics
+// latency are logged to stderr.
+class LanguageServer {
+public:
+    LanguageServer(int input, int output) : input(input), output(output) {}
+
+    int run() {
+        thread analyzer(&LanguageServer::analyze, this);
+        // Every way out of the loop, exceptions included, stops and joins the analyzer.
+        struct AnalyzerJoin {
+            LanguageServer* server;
+            thread& analyzer;
+            ~AnalyzerJoin() { server->stopAnalyzer(analyzer); }
+        } analyzerJoin{ this, analyzer };
+        SocketReader reader(input);
+        bool shutdownRequested = false;
+        int status = 1;
+        while (true) {
+            string header;
+            size_t length = 0;
+            bool lengthValid = false;
+            bool open;
+            while ((open = reader.readLine(header)) && header != "\r" && !header.empty()) {
+                if (header.compare(0, 15, "Content-Length:") == 0) {
+                    try {
+                        size_t parsed = 0;
+                        string value = header.substr(15);
+                        length = stoul(value, &parsed);
+                        lengthValid = value.find_first_not_of(" \t\r", parsed) == string::npos
+                                      && value.find('-') == string::npos;
+                    }
+                    catch (const exception&) {
+                        lengthValid = false;
+                    }
+                }
+            }
+            if (!open) break;
+            if (!lengthValid) {
+                // Without a length the body cannot be framed; the header scan
+                // above resynchronizes on the next blank line.
+                send("{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32700,\"message\":\"Missing or invalid Content-Length\"}}");
+                continue;
+            }
+            if (length > maxMessageBytes) {
+                if (!reader.skipBytes(length)) break;
+                send("{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32700,\"message\":\"Message larger than "
+                     + to_string(maxMessageBytes) + " bytes\"}}");
+                continue;
+            }
+            string body;
+            if (!reader.readBytes(length, body)) break;
+            auto received = chrono::steady_clock::now();
+
+            JsonValue message;
+            try {
+                message = JsonValue::parse(body);
+            }
+            catch (const exception& e) {
+                send("{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32700,\"message\":\"" + jsonEscape(e.what()) + "\"}}");
+                continue;
+            }
+            const string& method = message["method"].text;
+            const JsonValue& id = message["id"];
+            if (method == "exit") {
+                status = shutdownRequested ? 0 : 1;
+                break;
+            }
+            try {
+                if (id.kind == JsonValue::NUL) {
+                    handleNotification(method, message["params"], received);
+                }
+                else if (method == "shutdown") {
+                    shutdownRequested = true;
+                    reply(id, "null");
+                }
+                else {
+                    reply(id, handleRequest(method, message["params"]));
+                }
+            }
+            catch (const exception& e) {
+                if (id.kind != JsonValue::NUL) {
+                    bool unknown = dynamic_cast<const out_of_range*>(&e) != nullptr;
+                    send("{\"jsonrpc\":\"2.0\",\"id\":" + id.dump() + ",\"error\":{\"code\":" + (unknown ? "-32601" : "-32603")
+                         + ",\"message\":\"" + jsonEscape(e.what()) + "\"}}");
+                }
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - received).count();
+            cerr << "lsp: " << method << " handled in " << ms << " ms" << endl;
+        }
+        return status;
+    }
+
+    static constexpr int debounceMs = 10;
+    static constexpr size_t maxMessageBytes = 64 << 20;
+
+private:
+    void stopAnalyzer(thread& analyzer) {
+        {
+            lock_guard<mutex> lock(documentsMutex);
+            stopping = true;
+            for (auto& entry : documents) {
+                if (entry.second.running) entry.second.running->cancel();
+            }
+        }
+        wake.notify_all();
+        if (analyzer.joinable()) analyzer.join();
+    }
+
+    struct Document {
+        int version = 0;
+        vector<string> lines{ "" };
+        vector<vector<Token>> lineTokens{ {} };
+        bool pending = false;
+        chrono::steady_clock::time_point edited;  // Arrival of the newest edit
+        chrono::steady_clock::time_point due;     // Analyze no earlier than this
+        shared_ptr<CancellationToken> running;    // Parse of an older version
+    };
+
+    string handleRequest(const string& method, const JsonValue& params) {
+        if (method == "initialize") {
+            return "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                   "\"documentSymbolProvider\":true},\"serverInfo\":{\"name\":\"projectcc\"}}";
+        }
+        if (method == "textDocument/documentSymbol") {
+            return documentSymbols(params["textDocument"]["uri"].text);
+        }
+        throw out_of_range("Unsupported method: " + method);
+    }
+
+    void handleNotification(const string& method, const JsonValue& params, chrono::steady_clock::time_point received) {
+        const JsonValue& textDocument = params["textDocument"];
+        const string& uri = textDocument["uri"].text;
+        lock_guard<mutex> lock(documentsMutex);
+        if (method == "textDocument/didOpen") {
+            Document& document = documents[uri];
+            replaceLines(document, 0, document.lines.size(), textDocument["text"].text);
+            document.version = textDocument["version"].asInt();
+            schedule(document, received, received);
+        }
+        else if (method == "textDocument/didChange") {
+            auto it = documents.find(uri);
+            if (it == documents.end()) return;
+            Document& document = it->second;
+            for (const auto& change : params["contentChanges"].items) {
+                applyChange(document, change);
+            }
+            document.version = textDocument["version"].asInt(document.version + 1);
+            schedule(document, received, received + chrono::milliseconds(debounceMs));
+        }
+        else if (method == "textDocument/didClose") {
+            auto it = documents.find(uri);
+            if (it == documents.end()) return;
+            if (it->second.running) it->second.running->cancel();
+            documents.erase(it);
+            send("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":\""
+                 + jsonEscape(uri) + "\",\"diagnostics\":[]}}");
+        }
+    }
+
+    void schedule(Document& document, chrono::steady_clock::time_point edited, chrono::steady_clock::time_point due) {
+        if (document.running) {
+            document.running->cancel();
+            document.running.reset();
+        }
+        document.pending = true;
+        document.edited = edited;
+        document.due = due;
+        wake.notify_all();
+    }
+
+    void applyChange(Document& document, const JsonValue& change) {
+        const JsonValue& range = change["range"];
+        if (range.kind == JsonValue::NUL) {
+            replaceLines(document, 0, document.lines.size(), change["text"].text);
+            return;
+        }
+        auto locate = [&document](const JsonValue& position, size_t& line, size_t& offset) {
+            line = max(0, position["line"].asInt());
+            if (line >= document.lines.size()) {
+                line = document.lines.size() - 1;
+                offset = document.lines[line].size();
+                return;
+            }
+            offset = utf8Offset(document.lines[line], position["character"].asInt());
+        };
+        size_t startLine, startOffset, endLine, endOffset;
+        locate(range["start"], startLine, startOffset);
+        locate(range["end"], endLine, endOffset);
+        if (endLine < startLine || (endLine == startLine && endOffset < startOffset)) {
+            endLine = startLine;
+            endOffset = startOffset;
+        }
+        string text = document.lines[startLine].substr(0, startOffset) + change["text"].text
+                    + document.lines[endLine].substr(endOffset);
+        replaceLines(document, startLine, endLine + 1, text);
+    }
+
+    // Replaces lines [first, last) with `text` and lexes only the new lines.
+    void replaceLines(Document& document, size_t first, size_t last, const string& text) {
+        vector<string> lines;
+        vector<vector<Token>> tokens;
+        size_t start = 0;
+        while (true) {
+            size_t newline = text.find('\n', start);
+            string line = text.substr(start, newline == string::npos ? string::npos : newline - start);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            tokens.push_back(Lexer(line).tokenize());
+            lines.push_back(std::move(line));
+            if (newline == string::npos) break;
+            start = newline + 1;
+        }
+        document.lines.erase(document.lines.begin() + first, document.lines.begin() + last);
+        document.lines.insert(document.lines.begin() + first, make_move_iterator(lines.begin()), make_move_iterator(lines.end()));
+        document.lineTokens.erase(document.lineTokens.begin() + first, document.lineTokens.begin() + last);
+        document.lineTokens.insert(document.lineTokens.begin() + first, make_move_iterator(tokens.begin()), make_move_iterator(tokens.end()));
+    }
+
+    // The per-line tokens joined into the stream the parser expects, with
+    // their current line numbers.
+    static vector<Token> flatten(const Document& document) {
+        vector<Token> tokens;
+        for (size_t line = 0; line < document.lineTokens.size(); ++line) {
+            for (const Token& token : document.lineTokens[line]) {
+                tokens.push_back(token);
+                tokens.back().line = line + 1;
+            }
+        }
+        return tokens;
+    }
+
+    string lineRange(const Document& document, size_t line, size_t column, size_t length) const {
+        const string& text = document.lines[line];
+        int start = utf16Length(string_view(text).substr(0, column));
+        int end = start + utf16Length(string_view(text).substr(column, length));
+        return "{\"start\":{\"line\":" + to_string(line) + ",\"character\":" + to_string(start) + "},\"end\":{\"line\":"
+             + to_string(line) + ",\"character\":" + to_string(end) + "}}";
+    }
+
+    // Declarations in the current text: ints as variables, streams as files.
+    string documentSymbols(const string& uri) {
+        lock_guard<mutex> lock(documentsMutex);
+        auto it = documents.find(uri);
+        if (it == documents.end()) return "[]";
+        const Document& document = it->second;
+        vector<Token> tokens;
+        vector<pair<size_t, size_t>> positions;  // Line and byte column of each token
+        for (size_t line = 0; line < document.lineTokens.size(); ++line) {
+            size_t cursor = 0;
+            for (const Token& token : document.lineTokens[line]) {
+                // Only blanks separate tokens, so each token starts at the next
+                // non-blank character.
+                cursor = document.lines[line].find_first_not_of(" \t", cursor);
+                tokens.push_back(token);
+                positions.push_back({ line, cursor });
+                cursor += token.value.size();
+            }
+        }
+        string out = "[";
+        for (const auto& declaration : collectDeclarations(tokens)) {
+            auto position = positions[declaration.token];
+            out += string(out.size() > 1 ? "," : "") + "{\"name\":\"" + jsonEscape(declaration.name) + "\",\"kind\":"
+                 + (declaration.type == "int" ? "13" : "1") + ",\"containerName\":\"" + declaration.type
+                 + "\",\"location\":{\"uri\":\"" + jsonEscape(uri) + "\",\"range\":"
+                 + lineRange(document, position.first, position.second, declaration.name.size()) + "}}";
+        }
+        return out + "]";
+    }
+
+    // Background analysis: parses the document whose debounce expired first
+    // and publishes its diagnostics unless a newer version arrived meanwhile.
+    void analyze() {
+        unique_lock<mutex> lock(documentsMutex);
+        while (!stopping) {
+            auto next = documents.end();
+            for (auto it = documents.begin(); it != documents.end(); ++it) {
+                if (it->second.pending && (next == documents.end() || it->second.due < next->second.due)) next = it;
+            }
+            if (next == documents.end()) {
+                wake.wait(lock);
+                continue;
+            }
+            if (chrono::steady_clock::now() < next->second.due) {
+                wake.wait_until(lock, next->second.due);
+                continue;
+            }
+            string uri = next->first;
+            Document& document = next->second;
+            document.pending = false;
+            auto token = make_shared<CancellationToken>();
+            document.running = token;
+            vector<Token> tokens = flatten(document);
+            int version = document.version;
+            auto edited = document.edited;
+            lock.unlock();
+
+            auto parseStart = chrono::steady_clock::now();
+            StopCondition stop{ token.get() };
+            vector<Diagnostic> found;
+            bool interrupted = false;
+            try {
+                found = diagnoseTokens(tokens, 0, &stop);
+            }
+            catch (const CompileInterrupted&) {
+                interrupted = true;
+            }
+            double parseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - parseStart).count();
+
+            lock.lock();
+            auto it = documents.find(uri);
+            if (interrupted || it == documents.end() || it->second.version != version || it->second.pending) {
+                cerr << "lsp: dropped analysis of " << uri << " version " << version << " (superseded)" << endl;
+                continue;
+            }
+            it->second.running.reset();
+            string diagnostics;
+            for (const auto& diagnostic : found) {
+                string message = diagnostic.render(tokens);
+                size_t line = min<size_t>(max(1, diagnosticLine(message)) - 1, it->second.lines.size() - 1);
+                diagnostics += (diagnostics.empty() ? "{\"range\":" : ",{\"range\":")
+                             + lineRange(it->second, line, 0, it->second.lines[line].size())
+                             + ",\"severity\":1,\"source\":\"projectcc\",\"message\":\"" + jsonEscape(message) + "\"}";
+            }
+            send("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":\"" + jsonEscape(uri)
+                 + "\",\"version\":" + to_string(version) + ",\"diagnostics\":[" + diagnostics + "]}}");
+            double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - edited).count();
+            cerr << "lsp: diagnostics for " << uri << " version " << version << " published " << totalMs
+                 << " ms after the edit (parse " << parseMs << " ms)" << endl;
+        }
+    }
+
+    void reply(const JsonValue& id, const string& result) {
+        send("{\"jsonrpc\":\"2.0\",\"id\":" + id.dump() + ",\"result\":" + result + "}");
+    }
+
+    void send(const string& body) {
+        string message = "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+        lock_guard<mutex> lock(outputMutex);
+        for (size_t offset = 0; offset < message.size(); ) {
+            ssize_t written = ::write(output, message.data() + offset, message.size() - offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            offset += written;
+        }
+    }
+
+    int input;
+    int output;
+    mutex documentsMutex;
+    mutex outputMutex;
+    condition_variable wake;
+    map<string, Document> documents;
+    bool stopping = false;
+};
+
+chrono::steady_clock::time_point processStart = chrono::steady_clock::now();
+bool timeReportJson = false;
+
+// Printed at exit when --time-report is given. Phase wall times are summed
+// over threads, so on several threads they can add up to more than the total.
+void printTimeReport() {
+    double totalWallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - processStart).count();
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double totalCpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+                      + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+    ostringstream out;
+    out << fixed << setprecision(3);
+    if (timeReportJson) {
+        out << "{\"phases\":[";
+        for (int phase = 0; phase < PHASES; ++phase) {
+            const PhaseTotals& totals = phaseTotals[phase];
+            out << (phase ? "," : "") << "{\"name\":\"" << phaseNames[phase] << "\",\"calls\":" << totals.calls.load()
+                << ",\"wall_ms\":" << totals.wallNs.load() / 1e6 << ",\"cpu_ms\":" << totals.cpuNs.load() / 1e6 << "}";
+        }
+        out << "],\"total_wall_ms\":" << totalWallMs << ",\"total_cpu_ms\":" << totalCpuMs << "}\n";
+    }
+    else {
+        out << "Phase timing        calls      wall ms       cpu ms   wall %\n";
+        for (int phase = 0; phase < PHASES; ++phase) {
+            const PhaseTotals& totals = phaseTotals[phase];
+            if (totals.calls.load() == 0) continue;
+            double wallMs = totals.wallNs.load() / 1e6;
+            out << "  " << left << setw(12) << phaseNames[phase] << right << setw(11) << totals.calls.load()
+                << setw(13) << wallMs << setw(13) << totals.cpuNs.load() / 1e6
+                << setw(8) << setprecision(1) << (totalWallMs > 0 ? 100.0 * wallMs / totalWallMs : 0.0) << setprecision(3) << "\n";
+        }
+        out << "  " << left << setw(12) << "total" << right << setw(11) << "" << setw(13) << totalWallMs
+            << setw(13) << totalCpuMs << "\n";
+    }
+    cout.flush();
+    cerr << out.str();
+}
+
+uint64_t traceStartTicks = 0;
+chrono::steady_clock::time_point traceStartTime;
+string tracePath;
+
+// Writes every thread's events to tracePath as Chrome trace JSON (loadable in
+// Perfetto or chrome://tracing) and reports what one event costs to record.
+void writeTrace() {
+    // Threads that outlive main (detached connections) must stop writing into
+    // the rings before they are read.
+    tracingEnabled = false;
+    uint64_t endTicks = traceClock();
+    double elapsedUs = chrono::duration<double, micro>(chrono::steady_clock::now() - traceStartTime).count();
+    double ticksPerUs = elapsedUs > 0 ? (endTicks - traceStartTicks) / elapsedUs : 1;
+
+    const int samples = 100000;
+    TraceBuffer scratch;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < samples; ++i) {
+        scratch.record("overhead", "trace", "calibration", traceClock(), traceClock());
+    }
+    double nsPerEvent = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / samples;
+
+    lock_guard<mutex> lock(traceBuffersMutex);
+    ostringstream out;
+    out << fixed << setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    pid_t pid = getpid();
+    size_t events = 0;
+    size_t overwritten = 0;
+    bool first = true;
+    set<int32_t> threads;
+    for (const auto& buffer : traceBuffers) {
+        size_t written = buffer->written.load(memory_order_acquire);
+        size_t begin = written > TraceBuffer::capacity ? written - TraceBuffer::capacity : 0;
+        overwritten += begin;
+        for (size_t i = begin; i < written; ++i) {
+            const TraceEvent& event = buffer->events[i & (TraceBuffer::capacity - 1)];
+            threads.insert(event.threadId);
+            out << (first ? "" : ",") << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"ts\":"
+                << (event.start - traceStartTicks) / ticksPerUs << ",\"dur\":" << (event.end - event.start) / ticksPerUs
+                << ",\"pid\":" << pid << ",\"tid\":" << event.threadId;
+            if (event.detail[0]) {
+                out << ",\"args\":{\"detail\":\"" << jsonEscape(event.detail) << "\"}";
+            }
+            out << "}";
+            first = false;
+            ++events;
+        }
+    }
+    for (int32_t thread : threads) {
+        out << (first ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+            << ",\"tid\":" << thread << ",\"args\":{\"name\":\""
+            << (thread == pid ? string("main") : "thread " + to_string(thread)) << "\"}}";
+        first = false;
+    }
+    out << "]}\n";
+    ofstream file(tracePath, ios::binary);
+    file << out.str();
+    cout.flush();
+    cerr << "Trace: " << events << " events from " << threads.size() << " threads (" << traceBuffers.size() << " buffers) written to " << tracePath
+         << (file ? "" : " (write failed)") << ", " << overwritten << " overwritten; recording costs "
+         << nsPerEvent << " ns per event" << endl;
+}
+
+// Printed at exit with --perf-counters: IPC and cache and branch misses per
+// KB of source lexed, for every phase that ran.
+void printCounterReport() {
+    bool any = false;
+    for (const auto& opened : counterOpened) any = any || opened.load();
+    cout.flush();
+    if (!any) {
+        ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+        string level;
+        paranoid >> level;
+        cerr << "Hardware counters unavailable: " << strerror(counterOpenError.load())
+             << (level.empty() ? "" : " (kernel.perf_event_paranoid=" + level + ")") << endl;
+        return;
+    }
+    double kilobytes = max(1.0, sourceBytesLexed.load() / 1024.0);
+    auto column = [](bool available, double value, int precision) {
+        ostringstream cell;
+        cell << fixed << setprecision(precision) << setw(15);
+        if (available) cell << value;
+        else cell << "n/a";
+        return cell.str();
+    };
+    ostringstream out;
+    out << "Hardware counters         cycles   instructions            IPC  cache-miss/KB  branch-miss/KB\n";
+    uint64_t enabledNs = 0;
+    uint64_t runningNs = 0;
+    for (int phase = 0; phase < PHASES; ++phase) {
+        if (phaseTotals[phase].calls.load() == 0) continue;
+        double values[COUNTERS];
+        for (int counter = 0; counter < COUNTERS; ++counter) values[counter] = phaseCounterTotals[phase][counter].load();
+        bool scheduled = phaseCounterRunningNs[phase].load() > 0;
+        enabledNs += phaseCounterEnabledNs[phase].load();
+        runningNs += phaseCounterRunningNs[phase].load();
+        out << "  " << left << setw(10) << phaseNames[phase] << right
+            << column(scheduled && counterOpened[CYCLES_COUNTER], values[CYCLES_COUNTER], 0)
+            << column(scheduled && counterOpened[INSTRUCTIONS_COUNTER], values[INSTRUCTIONS_COUNTER], 0)
+            << column(scheduled && counterOpened[CYCLES_COUNTER] && counterOpened[INSTRUCTIONS_COUNTER] && values[CYCLES_COUNTER] > 0,
+                      values[INSTRUCTIONS_COUNTER] / max(1.0, values[CYCLES_COUNTER]), 2)
+            << column(scheduled && counterOpened[CACHE_MISSES_COUNTER], values[CACHE_MISSES_COUNTER] / kilobytes, 2)
+            << " " << column(scheduled && counterOpened[BRANCH_MISSES_COUNTER], values[BRANCH_MISSES_COUNTER] / kilobytes, 2) << "\n";
+    }
+    out << "  (" << sourceBytesLexed.load() << " bytes of source lexed";
+    if (runningNs < enabledNs) {
+        out << "; counters multiplexed, ran " << fixed << setprecision(1) << 100.0 * runningNs / enabledNs
+            << "% of the time, counts scaled";
+    }
+    out << ")\n";
+    cerr << out.str();
+}
+
+void printUsage() {
+    cerr << "Usage: ProjectCC [options] [source-file]" << endl
+         << "       ProjectCC [--jobs N] [--scaling] FILE|DIR|ARCHIVE.tar|@LIST..." << endl
+         << "  --jobs N            check many inputs on N threads (default: all cores)" << endl
+         << "  --scaling           time the batch at 1, 2, 4 ... N threads, compare outputs" << endl
+         << "  --reorder-window N  files that may finish ahead of the oldest pending one" << endl
+         << "  --index FILE        update the symbol index FILE from the inputs" << endl
+         << "  --lookup NAME       print declarations and uses of NAME from --index FILE" << endl
+         << "  --query PATTERN     print nodes matching PATTERN in the inputs (repeatable)" << endl
+         << "  --query-file FILE   run every 'label: pattern' line of FILE in one pass" << endl
+         << "  --trace FILE        write a Chrome trace of phases and files to FILE at exit" << endl
+         << "  --perf-counters     print hardware counters per phase at exit" << endl
+         << "  --time-report[=json]  print wall and CPU time per phase at exit" << endl
+         << "  --lsp               serve the Language Server Protocol on stdin/stdout" << endl
+         << "  --watch             check the inputs, then re-check files as they change" << endl
+         << "  --worker PORT       run a compile-farm worker on PORT (cache: --cache-dir)" << endl
+         << "  --worker-address A  address the worker binds (default 127.0.0.1)" << endl
+         << "  --coordinator H:P,...  check the inputs on the listed farm workers" << endl
+         << "  --farm N            run N local farm workers and coordinate the inputs" << endl
+         << "  --no-io-uring       read batch inputs with read(2) instead of io_uring" << endl
+         << "  --bench-write N     write N token dumps and report throughput" << endl
+         << "  --bench-compile N   lex and parse N times from memory" << endl
+         << "  --bench-startup N   compare N cold compiles with N cache hits" << endl
+         << "  --cache-dir DIR     reuse compiled programs and accepted parses stored in DIR" << endl
+         << "  --check             print only 'path: ok' or the diagnostic" << endl
+         << "  --fork-server       check each path read from stdin in a forked child" << endl
+         << "  --bench-fork N      compare N forked checks with N cold launches" << endl
+         << "  --daemon SOCKET     serve lex/parse/check requests on a Unix socket" << endl
+         << "  --client SOCKET [--batch] CMD [PATH...]  send requests to a running daemon" << endl
+         << "  --deadline-ms N     stop lexing/parsing after N ms (--check, --daemon)" << endl
+         << "  --bench-cancel N    measure cancellation polling overhead over N runs" << endl
+         << "  --bench-priority N  interactive p50/p99 latency while batch load runs" << endl
+         << "  --record FILE       save every file read during the run to FILE" << endl
+         << "  --replay FILE       read files from a recording instead of disk" << endl;
+}
+
+// Reads the non-negative decimal value of `flag`. Anything else is reported
+// with the usage text and returns false, so main can exit with status 2.
+bool parseNumberFlag(const string& flag, const char* text, int& value) {
+    char* end = nullptr;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < 0 || parsed > numeric_limits<int>::max()) {
+        cerr << "Invalid number for " << flag << ": " << text << endl;
+        printUsage();
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const string samplePath = "<sample>";
+    string inputPath = samplePath;
+    vector<string> inputs;
+    int jobs = 0;
+    bool scaling = false;
+    bool useIoUring = true;
+    int reorderWindow = 256;
+    int workerPort = -1;
+    string workerAddress = "127.0.0.1";
+    bool watch = false;
+    bool languageServer = false;
+    string indexPath;
+    vector<string> lookups;
+    vector<pair<string, bool>> queryLines;
+    string coordinatorList;
+    int farmWorkers = 0;
+    string recordPath;
+    string replayPath;
+    string cacheDir;
+    int benchWrite = 0;
+    int benchCompile = 0;
+    int benchStartup = 0;
+    int benchFork = 0;
+    int benchPriority = 0;
+    int benchCancel = 0;
+    int deadlineMs = 0;
+    bool checkOnly = false;
+    bool forkServer = false;
+    bool timeReportRequested = false;
+    string daemonSocket;
+    int clientArg = 0;  // Index of the socket after --client; the rest of argv is its request
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        // Each report registers its atexit handler only once, however often
+        // its flag is repeated.
+        if (arg == "--time-report" || arg == "--time-report=json") {
+            if (!timeReportRequested) atexit(printTimeReport);
+            timeReportRequested = true;
+            phaseTimingEnabled = true;
+            timeReportJson = arg == "--time-report=json";
+        }
+        else if (arg == "--perf-counters") {
+            if (!phaseCountersEnabled) atexit(printCounterReport);
+            phaseTimingEnabled = true;
+            phaseCountersEnabled = true;
+        }
+        else if (arg == "--trace" && hasValue) {
+            if (!tracingEnabled) {
+                traceStartTicks = traceClock();
+                traceStartTime = chrono::steady_clock::now();
+                atexit(writeTrace);
+            }
+            tracePath = argv[++i];
+            tracingEnabled = true;
+        }
+        else if (arg == "--bench-write" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchWrite)) return 2;
+        }
+        else if (arg == "--bench-compile" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchCompile)) return 2;
+        }
+        else if (arg == "--bench-startup" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchStartup)) return 2;
+        }
+        else if (arg == "--bench-fork" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchFork)) return 2;
+        }
+        else if (arg == "--bench-priority" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchPriority)) return 2;
+        }
+        else if (arg == "--bench-cancel" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], benchCancel)) return 2;
+        }
+        else if (arg == "--deadline-ms" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], deadlineMs)) return 2;
+        }
+        else if (arg == "--jobs" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], jobs)) return 2;
+        }
+        else if (arg == "--no-io-uring") {
+            useIoUring = false;
+        }
+        else if (arg == "--index" && hasValue) {
+            indexPath = argv[++i];
+        }
+        else if (arg == "--lookup" && hasValue) {
+            lookups.push_back(argv[++i]);
+        }
+        else if (arg == "--query" && hasValue) {
+            queryLines.push_back({ argv[++i], false });
+        }
+        else if (arg == "--query-file" && hasValue) {
+            ifstream file(argv[++i]);
+            if (!file) {
+                cerr << "Could not open query file: " << argv[i] << endl;
+                return 2;
+            }
+            string line;
+            while (getline(file, line)) {
+                queryLines.push_back({ line, true });
+            }
+        }
+        else if (arg == "--lsp") {
+            languageServer = true;
+        }
+        else if (arg == "--watch") {
+            watch = true;
+        }
+        else if (arg == "--worker" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], workerPort)) return 2;
+        }
+        else if (arg == "--worker-address" && hasValue) {
+            workerAddress = argv[++i];
+        }
+        else if (arg == "--coordinator" && hasValue) {
+            coordinatorList = argv[++i];
+        }
+        else if (arg == "--farm" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], farmWorkers)) return 2;
+        }
+        else if (arg == "--reorder-window" && hasValue) {
+            if (!parseNumberFlag(arg, argv[++i], reorderWindow)) return 2;
+        }
+        else if (arg == "--scaling") {
+            scaling = true;
+        }
+        else if (arg == "--check") {
+            checkOnly = true;
+        }
+        else if (arg == "--fork-server") {
+            forkServer = true;
+        }
+        else if (arg == "--daemon" && hasValue) {
+            daemonSocket = argv[++i];
+        }
+        else if (arg == "--client" && i + 2 < argc) {
+            clientArg = i + 1;
+            break;
+        }
+        else if (arg == "--cache-dir" && hasValue) {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--record" && hasValue) {
+            recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && hasValue) {
+            replayPath = argv[++i];
+        }
+        else if (!arg.empty() && arg[0] != '-') {
+            inputs.push_back(arg);
+        }
+        else {
+            printUsage();
+            return 2;
+        }
+    }
+
+    // Servers start only once every flag is known, so options given after
+    // --fork-server or --daemon (deadlines, reports, traces) still apply.
+    if (clientArg > 0) {
+        try {
+            bool batch = string(argv[clientArg + 1]) == "--batch" && clientArg + 2 < argc;
+            int first = batch ? clientArg + 3 : clientArg + 2;
+            string command = batch ? string("batch ") + argv[clientArg + 2] : string(argv[clientArg + 1]);
+            return runClient(argv[clientArg], command, vector<string>(argv + first, argv + argc));
+        }
+        catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 2;
+        }
+    }
+    if (forkServer || !daemonSocket.empty()) {
+        try {
+            if (forkServer) {
+                runForkServer();
+            }
+            else {
+                CompileDaemon(daemonSocket, 4096, max(2u, thread::hardware_concurrency()),
+                              chrono::milliseconds(deadlineMs)).serve();
+            }
+        }
+        catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    try {
+        string farmCache = cacheDir.empty() ? "/tmp/projectcc-farm-cache" : cacheDir;
+        if (workerPort >= 0) {
+            int listener = listenTcp(workerAddress, workerPort);
+            cerr << "Farm worker listening on port " << boundPort(listener) << endl;
+            FarmWorker(listener, farmCache).serve();
+            return 0;
+        }
+        if (!coordinatorList.empty()) {
+            return runCoordinator(parseEndpoints(coordinatorList), inputs);
+        }
+        if (farmWorkers > 0) {
+            return runLocalFarm(farmWorkers, farmCache, inputs);
+        }
+        if (!indexPath.empty()) {
+            if (!inputs.empty()) {
+                updateSymbolIndex(indexPath, inputs, jobs > 0 ? jobs : max(1u, thread::hardware_concurrency()));
+            }
+            return lookups.empty() ? 0 : lookupSymbols(indexPath, lookups);
+        }
+        if (!queryLines.empty()) {
+            return runTreeQueries(inputs, loadTreeQueries(queryLines), jobs > 0 ? jobs : max(1u, thread::hardware_concurrency()));
+        }
+        if (languageServer) {
+            return LanguageServer(STDIN_FILENO, STDOUT_FILENO).run();
+        }
+        if (watch) {
+            if (inputs.empty()) {
+                throw runtime_error("--watch needs a file or directory");
+            }
+            SourceWatcher(inputs).run();
+            return 0;
+        }
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 2;
+    }
+
+    bool batch = inputs.size() > 1 || jobs > 0 || scaling
+              || (inputs.size() == 1 && (inputs[0].rfind('@', 0) == 0 || std::filesystem::is_directory(inputs[0])
+                                         || (inputs[0].size() > 4 && inputs[0].compare(inputs[0].size() - 4, 4, ".tar") == 0)));
+    if (batch) {
+        try {
+            BatchOptions options;
+            options.threads = jobs > 0 ? jobs : max(1u, thread::hardware_concurrency());
+            options.deadlineMs = deadlineMs;
+            options.useIoUring = useIoUring;
+            options.reorderWindow = max(1, reorderWindow);
+            unique_ptr<ParseCache> parseCache;
+            if (!cacheDir.empty()) {
+                parseCache = make_unique<ParseCache>(cacheDir);
+                options.parseCache = parseCache.get();
+            }
+            return runBatch(inputs, options, scaling);
+        }
+        catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 2;
+        }
+    }
+    if (!inputs.empty()) {
+        inputPath = inputs[0];
+    }
+
+    DiskFileBackend disk;
+    MemoryFileBackend memory;
+    RecordingFileBackend recorder(disk);
+    FileBackend* files = &disk;
+    string code;
+    try {
+        if (!replayPath.empty()) {
+            memory.load(disk, replayPath);
+            files = &memory;
+        }
+        else if (!recordPath.empty()) {
+            files = &recorder;
+        }
+        if (inputPath == samplePath) {
+            code = sampleCode;
+        }
+        else {
+            code = files->readFile(inputPath);
+        }
+        if (!recordPath.empty()) {
+            recorder.recording().save(disk, recordPath);
+        }
+
+        if (benchWrite > 0) {
+            benchmarkWrite(code, benchWrite);
+            return 0;
+        }
+        if (benchCompile > 0) {
+            MemoryFileBackend benchFiles;
+            benchFiles.preload(inputPath, code);
+            benchmarkCompile(benchFiles, inputPath, benchCompile);
+            return 0;
+        }
+        if (benchStartup > 0) {
+            benchmarkStartup(code, cacheDir.empty() ? "/tmp" : cacheDir, benchStartup);
+            return 0;
+        }
+        if (benchCancel > 0) {
+            benchmarkCancellation(code, benchCancel);
+            return 0;
+        }
+        if (benchPriority > 0) {
+            benchmarkPriority(benchPriority, 4);
+            return 0;
+        }
+        if (benchFork > 0) {
+            if (inputPath == samplePath) {
+                throw runtime_error("--bench-fork needs a source file");
+            }
+            benchmarkFork(inputPath, benchFork);
+            return 0;
+        }
+        if (checkOnly) {
+            StopCondition stop;
+            if (deadlineMs > 0) {
+                stop = StopCondition::after(chrono::milliseconds(deadlineMs));
+            }
+            unique_ptr<ParseCache> parseCache;
+            if (!cacheDir.empty()) {
+                parseCache = make_unique<ParseCache>(cacheDir);
+            }
+            string diagnostic = checkSource(code, &stop, parseCache.get());
+            cout << inputPath << ": " << (diagnostic.empty() ? "ok" : diagnostic) << endl;
+            return diagnostic.empty() ? 0 : 1;
+        }
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    cout << "\t\t\tCompiler Construction Project" << endl << endl;
+    try {
+        vector<Token> tokens;
+        size_t constantCount;
+        uint64_t sourceHash = hashBytes(code.data(), code.size());
+        unique_ptr<CompiledProgram> program;
+        if (!cacheDir.empty()) {
+            program = CompiledProgram::load(compiledProgramPath(cacheDir, sourceHash), sourceHash, code.size());
+        }
+        if (program) {
+            tokens = program->tokens();
+            constantCount = program->constantPool().size();
+        }
+        else {
+            Lexer lexer(code);
+            tokens = lexer.tokenize();
+            constantCount = lexer.constantPool().size();
+            if (!cacheDir.empty()) {
+                // The cache only saves work next time; failing to fill it must not stop this compile.
+                try {
+                    writeCompiledProgram(compiledProgramPath(cacheDir, sourceHash), sourceHash, code.size(),
+                                         tokens, lexer.constantPool());
+                }
+                catch (const exception& e) {
+                    cerr << "Warning: " << e.what() << endl;
+                }
+            }
+        }
+        {
+            AsyncWriter out(STDOUT_FILENO);
+            printTokens(tokens, out);
+            out.close();
+        }
+        cout << "Constant pool: " << constantCount << " unique literals"
+             << (program ? " (loaded from compiled program cache)" : "") << endl;
 
         Parser parser(tokens);
         unique_ptr<ASTNode> syntaxTree = parser.parse();